@@ -9,6 +9,7 @@
 #define EC_SVC_64       0x15
 #define EC_IA_LE        0x20
 #define EC_DA_LE        0x24
+#define EC_DA_CE        0x25
 
 #define ISS_FSC(esr) (esr->iss & 0x3f)
 
@@ -17,6 +18,10 @@
 #define FSC_TF_L2       0b000110
 #define FSC_TF_L3       0b000111
 
+#define FSC_PF_L1       0b001101
+#define FSC_PF_L2       0b001110
+#define FSC_PF_L3       0b001111
+
 #define ISS_WnR(esr) (esr->iss & 0x40)
 
 typedef struct {
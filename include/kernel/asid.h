@@ -0,0 +1,53 @@
+#ifndef _ASID_H
+#define _ASID_H
+
+#include <types.h>
+
+struct _task_struct;
+
+/*
+ * task_struct.context_id: the ASID is in the low 16 bits, the generation
+ * it was allocated in is in the other bits. 0 means no ASID yet.
+ */
+#define ASID_FIELD_BITS 16
+#define ASID_MASK       ((1 << ASID_FIELD_BITS) - 1)
+
+#define context_asid(ctx) ((ctx) & ASID_MASK)
+
+/*
+ * Detect the ASID size, must be called before the first schedule().
+ */
+void asid_init(void);
+
+/*
+ * Load the page table of @next into TTBR0 with its ASID. An ASID is
+ * allocated if @next doesn't have one of the current generation. TTBR0
+ * isn't reloaded if @next uses the same page table and ASID as the running
+ * task.
+ * Must be called with interrupts disabled.
+ */
+void switch_mm(struct _task_struct *prev, struct _task_struct *next);
+
+/*
+ * Invalidate the TLB entries tagged with the ASID of @task on all cores.
+ */
+void flush_tlb_mm(struct _task_struct *task);
+
+/*
+ * Invalidate the TLB entry of the user address @va of @task on all cores.
+ */
+void flush_tlb_page(struct _task_struct *task, uint64 va);
+
+/*
+ * Invalidate the TLB entries of the user addresses @start ~ @end of @task
+ * on all cores.
+ */
+void flush_tlb_range(struct _task_struct *task, uint64 start, uint64 end);
+
+/*
+ * Invalidate the TLB entries of the kernel addresses @start ~ @end on all
+ * cores.
+ */
+void flush_tlb_kernel_range(uint64 start, uint64 end);
+
+#endif /* _ASID_H */
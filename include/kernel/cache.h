@@ -0,0 +1,22 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <types.h>
+
+/*
+ * Data cache maintenance by VA, to the Point of Coherency.
+ *
+ * Memory shared with the VideoCore (mailbox buffers, framebuffer) is not
+ * coherent with the ARM data cache, so it must be cleaned before the GPU
+ * reads it and invalidated before the CPU reads what the GPU wrote.
+ */
+void dcache_clean_range(void *start, uint64 size);
+void dcache_clean_inval_range(void *start, uint64 size);
+
+/*
+ * Make instructions written through the data side (e.g. a loaded program
+ * image) visible to instruction fetch.
+ */
+void icache_sync_range(void *start, uint64 size);
+
+#endif /* _CACHE_H */
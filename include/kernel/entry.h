@@ -5,5 +5,6 @@
 #include <trapframe.h>
 
 void el0_sync_handler(trapframe *regs, uint32 syn);
+void el1_sync_handler(trapframe *regs, uint32 syn);
 
 #endif /* _ENTRY_H */
\ No newline at end of file
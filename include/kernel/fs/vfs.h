@@ -19,6 +19,8 @@ struct vnode {
     struct file_operations *f_ops;
     struct vnode *parent;
     void *internal;
+    /* The pages of the file mapped by mmap, see vfs_getpage() */
+    struct page_cache *page_cache;
 };
 
 /* File handle */
@@ -62,10 +64,24 @@ struct vnode_operations {
     int (*isdir)(struct vnode *dir_node);
     int (*getname)(struct vnode *dir_node, const char **name);
     int (*getsize)(struct vnode *dir_node);
+    /*
+     * Fill @page with the PAGE_SIZE bytes at @offset of the file, the part
+     * beyond the end of the file is zeroed. Used by file-backed mmap.
+     */
+    int (*readpage)(struct vnode *file_node, void *page, uint64 offset);
+    /*
+     * Write @page back to @offset of the file, without growing the file.
+     * NULL if the filesystem is read-only.
+     */
+    int (*writepage)(struct vnode *file_node, const void *page,
+                     uint64 offset);
 };
 
 extern struct mount *rootmount;
 
+/* Filesystems allocate their vnodes from it */
+extern struct kmem_cache *vnode_cache;
+
 void vfs_init(void);
 void vfs_init_rootmount(struct filesystem *fs);
 
@@ -80,6 +96,48 @@ int vfs_mkdir(const char *pathname);
 int vfs_mount(const char *mountpath, const char *filesystem);
 int vfs_lookup(const char *pathname, struct vnode **target);
 int vfs_sync(struct filesystem *fs);
+int vfs_sync_all(void);
+int vfs_readpage(struct vnode *node, void *page, uint64 offset);
+int vfs_writepage(struct vnode *node, const void *page, uint64 offset);
+
+/*
+ * Return the page cached at @offset of @node, reading it in first if it
+ * isn't cached. A page_refs reference is taken for the caller, the page
+ * must be treated as read-only while it is shared. Return NULL on error.
+ */
+void *vfs_getpage(struct vnode *node, uint64 offset);
+/*
+ * Same as vfs_getpage(), but return NULL if the page isn't cached.
+ */
+void *vfs_findpage(struct vnode *node, uint64 offset);
+/*
+ * Drop the cached pages mapped by no one, return their count. Called when
+ * the Buddy System runs out of pages.
+ * Must be called with the kernel lock held.
+ */
+int vfs_shrink_page_cache(void);
+/*
+ * Add 1 to @refs[i] for each of the @n pages @pages[i] held by the cache.
+ * The cached pages are movable, migrate_user_pages() accounts for the
+ * cache with it.
+ * Must be called with the kernel lock held.
+ */
+void vfs_count_cached_pages(void **pages, uint32 *refs, int n);
+/*
+ * Cache @new[i] in place of @old[i], for each of the @n pages cached.
+ * Must be called with the kernel lock held.
+ */
+void vfs_replace_cached_pages(void **old, void **new, int n);
+void vfs_page_cache_stat_show(void);
+
+#ifdef STRING_BENCH
+/*
+ * Time the lookups of a deep tmpfs path made under /bench, and the name
+ * compares of them with the word-at-a-time and the byte-by-byte strcmp()
+ * and strcasecmp().
+ */
+void vfs_lookup_bench(void);
+#endif
 
 void syscall_open(trapframe *frame, const char *pathname, int flags);
 void syscall_close(trapframe *frame, int fd);
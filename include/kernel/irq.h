@@ -14,6 +14,12 @@ int irq_run_task(void (*task)(void *),
                  uint32 prio);
 
 void irq_handler();
+
+/*
+ * Return 1 if the running CPU is handling an interrupt.
+ */
+int in_interrupt(void);
+
 void exception_default_handler(uint32 n);
 void irq1_enable(int bit);
 
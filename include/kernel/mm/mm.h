@@ -4,6 +4,8 @@
 #include <mm/early_alloc.h>
 #include <mm/page_alloc.h>
 #include <mm/sc_alloc.h>
+#include <mm/zero_pool.h>
+#include <mm/vmalloc.h>
 
 void mm_init(void);
 
@@ -11,4 +13,12 @@ void *kmalloc(int size);
 
 void kfree(void *ptr);
 
+#ifdef MEM_BENCH
+/*
+ * Print the bytes per CPU cycle of memncpy(), memset() and memmove() for
+ * sizes from 16 bytes to 64 KB, next to a byte-by-byte loop.
+ */
+void mem_bench(void);
+#endif
+
 #endif /* _MM_H */
\ No newline at end of file
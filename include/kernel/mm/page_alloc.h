@@ -50,8 +50,57 @@ void *alloc_pages(int num);
  */
 void *alloc_page(void);
 
+/*
+ * Allocate 1 page to be mapped into user space. Such pages are kept apart
+ * from the kernel's, and may be moved elsewhere to make room for a larger
+ * block, see migrate_user_pages(). Free it with free_page().
+ * Return NULL if failed.
+ */
+void *alloc_page_movable(void);
+
+/*
+ * Allocate @num contiguous pages without rounding @num up to a power of 2,
+ * the rest of the block is returned to the Buddy System at once.
+ * Return NULL if failed.
+ */
+void *alloc_pages_exact(int num);
+
+/*
+ * Free the pages allocated by alloc_pages_exact(). free_page() does the
+ * same when given such pages.
+ */
+void free_pages_exact(void *page);
+
 void free_page(void *page);
 
+/*
+ * Same as free_page(), but the content of @page is unlikely to be in the
+ * cache, so it is handed out after the hot pages.
+ */
+void free_page_cold(void *page);
+
+/*
+ * Return the pages cached by the running CPU to the Buddy System.
+ */
+void drain_local_pages(void);
+
+/*
+ * Reference count of the frame containing @page, used to share user pages
+ * between address spaces (copy-on-write). page_ref_init() sets it to 1,
+ * page_ref_dec() returns the remaining count.
+ * Must be called with the kernel lock held.
+ */
+void page_ref_init(void *page);
+void page_ref_inc(void *page);
+uint32 page_ref_dec(void *page);
+uint32 page_ref_count(void *page);
+
+/*
+ * Print the free blocks of each order and migrate type, the compaction
+ * counters and the per-CPU page lists.
+ */
+void page_stat_show(void);
+
 #ifdef MM_DEBUG
 void page_allocator_test(void);
 #endif
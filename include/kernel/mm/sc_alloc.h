@@ -14,6 +14,38 @@ void *sc_alloc(int size);
  */
 int sc_free(void *sc);
 
+struct kmem_cache;
+
+/*
+ * Create a cache of @size-byte objects aligned to @align.
+ *
+ * If @ctor is given, it is called on every object when a new page is
+ * split for the cache, and objects must be freed in the constructed
+ * state. @ctor must not allocate memory.
+ *
+ * Return NULL if failed.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, uint32 size,
+                                     uint32 align, void (*ctor)(void *));
+
+/*
+ * Return NULL if failed.
+ */
+void *kmem_cache_alloc(struct kmem_cache *cache);
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+/*
+ * Return the empty pages of all caches to the Buddy System.
+ * Return the number of pages reclaimed.
+ */
+int sc_shrink(void);
+
+/*
+ * Print the per-CPU magazine hit counters and the usage of each cache.
+ */
+void sc_stat_show(void);
+
 #ifdef MM_DEBUG
 void sc_test(void);
 #endif
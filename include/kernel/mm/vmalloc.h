@@ -0,0 +1,35 @@
+#ifndef _VMALLOC_H
+#define _VMALLOC_H
+
+#include <types.h>
+
+/*
+ * Kernel addresses (TTBR1) mapping the pages of vmalloc() one by one, so
+ * large allocations don't need physically contiguous pages. Such memory
+ * can't be handed to VA2PA() users (DMA, user mappings by VMA_KVA).
+ */
+#define VMALLOC_START   0xffff800000000000
+#define VMALLOC_END     0xffff800040000000
+
+static inline int is_vmalloc_addr(const void *addr)
+{
+    return VMALLOC_START <= (uint64)addr && (uint64)addr < VMALLOC_END;
+}
+
+void vmalloc_init(void);
+
+/*
+ * Allocate @size bytes, rounded up to pages, followed by an unmapped
+ * guard page. Return NULL if failed.
+ */
+void *vmalloc(uint64 size);
+
+/*
+ * Free the memory of vmalloc(). The TLB entries of the range are purged
+ * lazily, together with the ranges freed later.
+ */
+void vfree(void *addr);
+
+void vmalloc_stat_show(void);
+
+#endif /* _VMALLOC_H */
@@ -0,0 +1,22 @@
+#ifndef _ZERO_POOL_H
+#define _ZERO_POOL_H
+
+#include <types.h>
+
+/*
+ * Return a zeroed page allocated by alloc_page_movable(). It is taken from
+ * the pool of pre-zeroed pages, or zeroed now if the pool is empty. Free it
+ * with free_page(), or kfree() which hands it to free_page().
+ * Return NULL if failed.
+ */
+void *zero_page_alloc(void);
+
+/*
+ * Zero one more page for the pool, called by the idle task.
+ * Return 0 if the pool is full or no page can be allocated.
+ */
+int zero_pool_refill(void);
+
+void zero_pool_stat_show(void);
+
+#endif /* _ZERO_POOL_H */
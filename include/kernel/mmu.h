@@ -3,14 +3,22 @@
 
 #include <types.h>
 #include <list.h>
+#include <rbtree.h>
 #include <arm.h>
 #include <trapframe.h>
 
 #define PAGE_TABLE_SIZE 0x1000
 
+// 48-bit user address space
+#define USER_VA_END     0x0001000000000000
+// Where mmap() starts to look for free space without a hint
+#define MMAP_BASE       0x550000000000
+
 #define PT_R    0x0001
 #define PT_W    0x0002
 #define PT_X    0x0004
+// Normal Non-cacheable (memory shared with the VideoCore)
+#define PT_NC   0x0040
 
 #define VMA_R       PT_R
 #define VMA_W       PT_W
@@ -21,23 +29,40 @@
 #define VMA_KVA     0x0010
 // Anonymous
 #define VMA_ANON    0x0020
+#define VMA_NC      PT_NC
+// Backed by vm_area_t.vnode, filled by vfs_readpage()
+#define VMA_FILE    0x0080
+// The writes are shared (and written back to the file)
+#define VMA_SHARED  0x0100
 
 typedef uint64 pd_t;
 
-/* TODO: The vm_area_t linked list is not sorted, making it an ordered list. */
+struct vnode;
+
 typedef struct _vm_area_t {
-    /* @list links to next vm_area_t */
+    /* @list links to next vm_area_t, sorted by address */
     struct list_head list;
+    /* @rb is the node of vm_area_meta_t.rb, sorted by address */
+    struct rb_node rb;
     uint64 va_begin;
     uint64 va_end;
     uint64 flag;
     /* @kva: Mapped kernel virtual address */
     uint64 kva;
+    /* @vnode, @file_offset: The file mapped by a VMA_FILE vm_area_t */
+    struct vnode *vnode;
+    uint64 file_offset;
+    /* @gap: Free space between the previous vm_area_t and @va_begin */
+    uint64 gap;
+    /* @max_gap: Largest @gap in the subtree of @rb */
+    uint64 max_gap;
 } vm_area_t;
 
 typedef struct {
     /* @vma links all vm_area_t */
     struct list_head vma;
+    /* @rb indexes all vm_area_t for vma_find() and the gap search */
+    struct rb_root rb;
 } vm_area_meta_t;
 
 /*
@@ -45,37 +70,137 @@ typedef struct {
  */
 void mmu_init(void);
 
+/*
+ * Enable MMU of core 1 ~ 3 with the page tables set by mmu_init()
+ */
+void mmu_init_secondary(void);
+
+/*
+ * Allocate an empty page table of a task. Return NULL if failed.
+ */
 pd_t *pt_create(void);
+
+/*
+ * Free the page table @pt. @pt must not be used by any core: no TLB
+ * maintenance is done here, the TLB entries of @pt are dropped at once
+ * by its ASID (flush_tlb_mm()) or by the next ASID rollover.
+ */
 void pt_free(pd_t *pt);
 
 /*
- * Create a @size mapping of @va -> @pa.
+ * Print the number of pages used by the page tables of the tasks, and by
+ * the kernel tables of the vmalloc range.
+ */
+void pt_stat_show(void);
+
+/*
+ * Create a @size mapping of @va -> @pa, the pages already mapped are kept.
  * @pt is PGD.
+ * Return the number of pages newly mapped.
+ */
+uint64 pt_map(pd_t *pt, void *va, uint64 size, void *pa, uint64 flag);
+
+/*
+ * Map the page at @pa to the kernel address @va (TTBR1): read-write for
+ * EL1 only, not executable. The missing tables are created.
+ * Return -1 if a table can't be allocated.
+ */
+int kernel_map_page(uint64 va, uint64 pa);
+
+/*
+ * Clear the kernel mapping of @va, return the PA it mapped or 0. The TLB
+ * entry is left to the caller, see flush_tlb_kernel_range().
+ */
+uint64 kernel_unmap_page(uint64 va);
+
+/* Maximum @n of migrate_user_pages() */
+#define MIGRATE_BATCH 32
+
+/*
+ * Move the user pages @old[i] to the free pages @new[i]: the content is
+ * copied and every PTE mapping @old[i] points to @new[i] afterwards. The
+ * references of @old[i] aren't moved. Nothing is changed and -1 is
+ * returned if some page has references the page tables and the page cache
+ * don't account for.
+ * Must be called with the kernel lock held.
+ */
+int migrate_user_pages(void **old, void **new, int n);
+
+/*
+ * Create the cache of vm_area_t, must be called after mm_init().
  */
-void pt_map(pd_t *pt, void *va, uint64 size, void *pa, uint64 flag);
+void vma_init(void);
 
 vm_area_meta_t *vma_meta_create(void);
 void vma_meta_free(vm_area_meta_t *vma_meta, pd_t *page_table);
-void vma_meta_copy(vm_area_meta_t *to, vm_area_meta_t *from, pd_t *page_table);
 
-void vma_map(vm_area_meta_t *vma_meta, void *va, uint64 size,
-             uint64 flag, void *addr);
+/*
+ * Copy the vm_area_t of @from into @to. The pages mapped in @from_pt are
+ * shared with @to_pt, read-only, and are copied on the first write.
+ */
+void vma_meta_copy(vm_area_meta_t *to, vm_area_meta_t *from,
+                   pd_t *to_pt, pd_t *from_pt);
+
+/*
+ * Map @size bytes at @va. @addr is the PA (VMA_PA), the kernel VA (VMA_KVA)
+ * or the vnode (VMA_FILE) backing the region.
+ * Return NULL if @va is not aligned or already mapped.
+ */
+vm_area_t *vma_map(vm_area_meta_t *vma_meta, void *va, uint64 size,
+                   uint64 flag, void *addr);
 
 void mem_abort(esr_el1_t *esr);
 
+#ifdef CACHE_BENCH
+/*
+ * Compare the memory throughput of the cacheable mapping with the
+ * non-cacheable one used before caches were enabled.
+ */
+void mmu_cache_bench(void);
+#endif
+
 /* syscalls */
 #define PROT_NONE   0
 #define PROT_READ   1
 #define PROT_WRITE  2
 #define PROT_EXEC   4
 
+#define MAP_SHARED          0x0001
+#define MAP_PRIVATE         0x0002
 #define MAP_ANONYMOUS       0x0020
 #define MAP_POPULATE        0x8000
 
+#define MADV_DONTNEED       4
+
 /*
- * TODO: @fd, @file_offset are ignored currently.
+ * Without MAP_ANONYMOUS, map the file @fd from @file_offset (page aligned).
+ * The pages are read on the first access into the page cache of the file,
+ * see vfs_getpage(). With MAP_SHARED, all the mappings of the file share
+ * the cached pages, and the written pages are written back to the file
+ * when a mapping goes away. write() to the file updates the cached pages
+ * too, so the mappings see it.
+ * MAP_POPULATE maps zeroed anonymous pages at once.
  */
 void syscall_mmap(trapframe *frame, void *addr, size_t len, int prot,
                   int flags, int fd, int file_offset);
 
+/*
+ * Unmap @addr (page aligned) ~ @addr + @len, the regions partly covered
+ * are split. Return 0, or -1 if the arguments are invalid.
+ */
+void syscall_munmap(trapframe *frame, void *addr, size_t len);
+
+/*
+ * Change the access of @addr (page aligned) ~ @addr + @len to @prot.
+ * Return 0, or -1 if the range isn't fully mapped or @prot isn't allowed.
+ */
+void syscall_mprotect(trapframe *frame, void *addr, size_t len, int prot);
+
+/*
+ * MADV_DONTNEED: drop the pages of @addr (page aligned) ~ @addr + @len,
+ * the anonymous ones read as zero again, the file ones are read again.
+ * Return 0, or -1 if the range isn't fully mapped or can't be dropped.
+ */
+void syscall_madvise(trapframe *frame, void *addr, size_t len, int advice);
+
 #endif /* _MMU_H */
\ No newline at end of file
@@ -7,12 +7,26 @@ void switch_to(task_struct *from, task_struct *to);
 
 void scheduler_init(void);
 
+/* Start the scheduler tick of core 1 ~ 3 */
+void scheduler_init_secondary(void);
+
 void schedule(void);
 
 void schedule_tick(void);
 
+/*
+ * Add @task to the run queue of the least loaded online core.
+ */
 void sched_add_task(task_struct *task);
 
+void sched_add_task_on(task_struct *task, int cpu);
+
 void sched_del_task(task_struct *task);
 
-#endif /* _SCHED_H */
\ No newline at end of file
+/*
+ * Make @task the idle task of @cpu. The idle task isn't in the run queue,
+ * it runs only when the run queue is empty.
+ */
+void sched_set_idle(task_struct *task, int cpu);
+
+#endif /* _SCHED_H */
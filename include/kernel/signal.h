@@ -68,10 +68,18 @@ struct sighand_t {
     struct sigaction_t sigactions[NSIG];
 };
 
+void signal_init(void);
+
 struct signal_head_t *signal_head_create(void);
 void signal_head_free(struct signal_head_t *head);
 void signal_head_reset(struct signal_head_t *head);
 
+/*
+ * Return nonzero if current task may have a pending signal. It's called
+ * without the kernel lock, handle_signal() checks it again.
+ */
+int signal_pending(void);
+
 void handle_signal(trapframe *_);
 
 struct sighand_t *sighand_create(void);
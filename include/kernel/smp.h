@@ -0,0 +1,44 @@
+#ifndef _SMP_H
+#define _SMP_H
+
+#include <types.h>
+#include <utils.h>
+
+#define NR_CPUS 4
+
+/* Bit n is set once core n is running the scheduler */
+extern uint32 cpu_online_mask;
+
+#define cpu_online(cpu) (cpu_online_mask & (1 << (cpu)))
+
+static inline int smp_processor_id(void)
+{
+    return read_sysreg(mpidr_el1) & 0xff;
+}
+
+/*
+ * Release core 1 ~ 3 from the firmware spin table. Each core gets its own
+ * idle task (stack and tpidr_el1), core timer and run queue.
+ */
+void smp_init(void);
+
+/* Called by _secondary_start in head.S with the MMU enabled */
+void secondary_start_kernel(int cpu);
+
+/*
+ * Big kernel lock.
+ *
+ * Serializes syscalls, page faults and signal delivery across cores. It is
+ * owned by a task (not by a core): schedule() drops it when switching out a
+ * task that holds it and takes it back when that task is switched in.
+ * Must not be taken in interrupt context.
+ */
+void lock_kernel(void);
+void unlock_kernel(void);
+
+struct _task_struct;
+
+void release_kernel_lock(struct _task_struct *task);
+void reacquire_kernel_lock(struct _task_struct *task);
+
+#endif /* _SMP_H */
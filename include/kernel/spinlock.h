@@ -0,0 +1,311 @@
+#ifndef _SPINLOCK_H
+#define _SPINLOCK_H
+
+#include <types.h>
+#include <utils.h>
+
+#ifdef LOCK_STAT
+struct lock_stat {
+    const char *name;
+    /* Number of times the lock was taken */
+    uint64 acquired;
+    /* Number of acquisitions that had to wait for another owner */
+    uint64 contended;
+    /* Total rounds spent waiting in WFE */
+    uint64 spins;
+    /* Longest time the lock was held, in cntpct_el0 ticks */
+    uint64 max_hold;
+    uint64 hold_start;
+    uint32 registered;
+};
+
+void lock_stat_acquired(struct lock_stat *stat, uint32 spins);
+void lock_stat_released(struct lock_stat *stat);
+
+/* Print the statistics of every lock taken so far */
+void lock_stat_show(void);
+
+#define __LOCK_STAT_INIT(lockname) , .stat = { .name = lockname }
+#else
+#define __LOCK_STAT_INIT(lockname)
+#endif
+
+/*
+ * Ticket lock.
+ *
+ * A locker takes the ticket @next and waits until @owner reaches it, so
+ * lockers are served in FIFO order. Unlocking increases @owner.
+ */
+typedef struct {
+    union {
+        volatile uint32 val;
+        struct {
+            volatile uint16 owner;
+            volatile uint16 next;
+        };
+    };
+#ifdef LOCK_STAT
+    struct lock_stat stat;
+#endif
+} spinlock_t;
+
+/*
+ * Reader-writer lock.
+ *
+ * Bit 31 of @val is set while a writer holds the lock, the lower bits count
+ * the readers. Writers are not prioritized over readers.
+ */
+typedef struct {
+    volatile uint32 val;
+} rwlock_t;
+
+#define SPINLOCK_INIT(lockname) { .val = 0 __LOCK_STAT_INIT(lockname) }
+#define RWLOCK_INIT { .val = 0 }
+
+static inline void spin_lock_init(spinlock_t *lock, const char *name)
+{
+    lock->val = 0;
+
+#ifdef LOCK_STAT
+    lock->stat.name = name;
+    lock->stat.acquired = 0;
+    lock->stat.contended = 0;
+    lock->stat.spins = 0;
+    lock->stat.max_hold = 0;
+    lock->stat.registered = 0;
+#endif
+}
+
+static inline void rwlock_init(rwlock_t *lock)
+{
+    lock->val = 0;
+}
+
+#ifndef MMU_NOCACHE
+
+/*
+ * Return the number of WFE rounds spent waiting (0 if uncontended).
+ */
+static inline uint32 arch_spin_lock(spinlock_t *lock)
+{
+    uint32 ticket, newval, tmp, spins;
+
+    spins = 0;
+
+    asm volatile(
+        // Take a ticket
+        "1: ldaxr %w[ticket], [%[lock]]\n"
+        "   add %w[newval], %w[ticket], #(1 << 16)\n"
+        "   stxr %w[tmp], %w[newval], [%[lock]]\n"
+        "   cbnz %w[tmp], 1b\n"
+        // Done if @owner == our ticket
+        "   eor %w[tmp], %w[ticket], %w[ticket], ror #16\n"
+        "   cbz %w[tmp], 3f\n"
+        // Wait for the unlocker to update @owner
+        "   sevl\n"
+        "2: wfe\n"
+        "   add %w[spins], %w[spins], #1\n"
+        "   ldaxrh %w[tmp], [%[lock]]\n"
+        "   eor %w[tmp], %w[tmp], %w[ticket], lsr #16\n"
+        "   cbnz %w[tmp], 2b\n"
+        "3:\n"
+        : [ticket] "=&r" (ticket), [newval] "=&r" (newval),
+          [tmp] "=&r" (tmp), [spins] "+r" (spins)
+        : [lock] "r" (&lock->val)
+        : "memory"
+    );
+
+    return spins;
+}
+
+static inline void arch_spin_unlock(spinlock_t *lock)
+{
+    uint32 tmp;
+
+    asm volatile(
+        "ldrh %w0, [%1]\n"
+        "add %w0, %w0, #1\n"
+        "stlrh %w0, [%1]\n"
+        : "=&r" (tmp)
+        : "r" (&lock->owner)
+        : "memory"
+    );
+}
+
+static inline void read_lock(rwlock_t *lock)
+{
+    uint32 tmp, tmp2;
+
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr %w0, [%2]\n"
+        "   add %w0, %w0, #1\n"
+        "   tbnz %w0, #31, 1b\n"
+        "   stxr %w1, %w0, [%2]\n"
+        "   cbnz %w1, 2b\n"
+        : "=&r" (tmp), "=&r" (tmp2)
+        : "r" (&lock->val)
+        : "memory"
+    );
+}
+
+static inline void read_unlock(rwlock_t *lock)
+{
+    uint32 tmp, tmp2;
+
+    asm volatile(
+        "1: ldxr %w0, [%2]\n"
+        "   sub %w0, %w0, #1\n"
+        "   stlxr %w1, %w0, [%2]\n"
+        "   cbnz %w1, 1b\n"
+        : "=&r" (tmp), "=&r" (tmp2)
+        : "r" (&lock->val)
+        : "memory"
+    );
+}
+
+static inline void write_lock(rwlock_t *lock)
+{
+    uint32 tmp;
+
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr %w0, [%1]\n"
+        "   cbnz %w0, 1b\n"
+        "   stxr %w0, %w2, [%1]\n"
+        "   cbnz %w0, 2b\n"
+        : "=&r" (tmp)
+        : "r" (&lock->val), "r" (0x80000000)
+        : "memory"
+    );
+}
+
+static inline void write_unlock(rwlock_t *lock)
+{
+    asm volatile(
+        "stlr wzr, [%0]\n"
+        :: "r" (&lock->val)
+        : "memory"
+    );
+}
+
+#else
+
+/*
+ * BCM2837 has no global exclusive monitor, so LDAXR/STXR never succeed on
+ * non-cacheable memory. MMU_NOCACHE kernels only run on core 0, where
+ * masking interrupts / preemption around the lock is enough.
+ */
+static inline uint32 arch_spin_lock(spinlock_t *lock)
+{
+    lock->next += 1;
+    asm volatile("" ::: "memory");
+
+    return 0;
+}
+
+static inline void arch_spin_unlock(spinlock_t *lock)
+{
+    asm volatile("" ::: "memory");
+    lock->owner += 1;
+}
+
+static inline void read_lock(rwlock_t *lock)
+{
+    lock->val += 1;
+    asm volatile("" ::: "memory");
+}
+
+static inline void read_unlock(rwlock_t *lock)
+{
+    asm volatile("" ::: "memory");
+    lock->val -= 1;
+}
+
+static inline void write_lock(rwlock_t *lock)
+{
+    lock->val = 0x80000000;
+    asm volatile("" ::: "memory");
+}
+
+static inline void write_unlock(rwlock_t *lock)
+{
+    asm volatile("" ::: "memory");
+    lock->val = 0;
+}
+
+#endif /* MMU_NOCACHE */
+
+static inline void spin_lock(spinlock_t *lock)
+{
+    uint32 spins;
+
+    spins = arch_spin_lock(lock);
+
+#ifdef LOCK_STAT
+    lock_stat_acquired(&lock->stat, spins);
+#else
+    (void)spins;
+#endif
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+#ifdef LOCK_STAT
+    lock_stat_released(&lock->stat);
+#endif
+
+    arch_spin_unlock(lock);
+}
+
+static inline uint32 spin_lock_irqsave(spinlock_t *lock)
+{
+    uint32 daif;
+
+    daif = save_and_disable_interrupt();
+    spin_lock(lock);
+
+    return daif;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint32 daif)
+{
+    spin_unlock(lock);
+    restore_interrupt(daif);
+}
+
+static inline uint32 read_lock_irqsave(rwlock_t *lock)
+{
+    uint32 daif;
+
+    daif = save_and_disable_interrupt();
+    read_lock(lock);
+
+    return daif;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t *lock, uint32 daif)
+{
+    read_unlock(lock);
+    restore_interrupt(daif);
+}
+
+static inline uint32 write_lock_irqsave(rwlock_t *lock)
+{
+    uint32 daif;
+
+    daif = save_and_disable_interrupt();
+    write_lock(lock);
+
+    return daif;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t *lock, uint32 daif)
+{
+    write_unlock(lock);
+    restore_interrupt(daif);
+}
+
+#endif /* _SPINLOCK_H */
@@ -26,6 +26,9 @@
 #define SCNUM_SYNC          20
 #define SCNUM_SIGRETURN     21
 #define SCNUM_SHOW_INFO     22
+#define SCNUM_MUNMAP        23
+#define SCNUM_MPROTECT      24
+#define SCNUM_MADVISE       25
 
 void syscall_handler(trapframe *regs);
 
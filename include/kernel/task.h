@@ -38,7 +38,11 @@ struct pt_regs {
 typedef struct _task_struct {
     struct pt_regs regs;
     pd_t *page_table;
+    /* @on_cpu is cleared by switch_to once the task has been switched out */
+    uint64 on_cpu;
     /* The order of the above elements cannot be changed */
+    /* ASID and its generation, see include/kernel/asid.h */
+    uint64 context_id;
     vm_area_meta_t *address_space;
     void *kernel_stack;
     /* @list is used by run_queue / wait_queue */
@@ -49,6 +53,13 @@ typedef struct _task_struct {
     uint16 need_resched:1;
     uint32 tid;
     uint32 preempt;
+    /* The core whose run queue this task belongs to */
+    uint32 cpu;
+    /* Nesting depth of lock_kernel() */
+    uint32 lock_depth;
+    /* Page faults taken, and pages mapped ahead by them (fault-around) */
+    uint32 nr_faults;
+    uint32 nr_fault_around;
     /* Signal */
     struct signal_head_t *signal;
     struct sighand_t *sighand;
@@ -78,6 +89,14 @@ void task_free(task_struct *task);
 
 task_struct *task_get_by_tid(uint32 tid);
 
+/*
+ * Call @f on each task. The task list is only locked to step to the next
+ * task, @f runs with the interrupts as the caller left them.
+ * Must be called with the kernel lock held and preemption disabled, so no
+ * task is freed meanwhile.
+ */
+void task_for_each(void (*f)(task_struct *task, void *arg), void *arg);
+
 /*
  * Create initial mapping for user program
  *
@@ -89,4 +108,9 @@ void task_init_map(task_struct *task);
 
 void task_reset_mm(task_struct *task);
 
+/*
+ * Print the page fault counters of each task.
+ */
+void task_fault_stat_show(void);
+
 #endif /* _TASK_H */
\ No newline at end of file
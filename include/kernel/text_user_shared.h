@@ -12,6 +12,14 @@
 
 #define SECTION_TUS __attribute__ ((section (".text.user.shared")))
 
+/*
+ * memcpy(dst, src, n), memset(ptr, value, n) and memmove(dst, src, n) for the
+ * user programs, the entries are fixed at the start of the section.
+ */
+#define TUS_MEMCPY  0x7f0000000000
+#define TUS_MEMSET  0x7f0000000004
+#define TUS_MEMMOVE 0x7f0000000008
+
 #define TUS2VA(x) ((((uint64)x) - TEXT_USER_SHARED_BASE) + 0x7f0000000000)
 
 /* From linker.ld */
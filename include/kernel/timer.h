@@ -13,4 +13,10 @@ void timer_add_proc_after(void (*proc)(void *), void *args, uint32 after);
 /* Call @proc(@args) after 1/@freq second. */
 void timer_add_proc_freq(void (*proc)(void *), void *args, uint32 freq);
 
+/*
+ * Call @tick() @freq times per second from the timer interrupt of the
+ * calling core. Only used by core 1 ~ 3, which don't run timer_proc.
+ */
+void timer_init_core_tick(void (*tick)(void), uint32 freq);
+
 #endif /* _TIMER_H */
\ No newline at end of file
@@ -2,8 +2,10 @@
 #define _WAITQUEUE_H
 
 #include <task.h>
+#include <spinlock.h>
 
 typedef struct {
+    spinlock_t lock;
     struct list_head list;
 } wait_queue_head;
 
@@ -12,7 +14,7 @@ wait_queue_head *wq_create(void);
 int wq_empty(wait_queue_head *head);
 
 void wq_add_task(task_struct *task, wait_queue_head *head);
-void wq_del_task(task_struct *task);
+void wq_del_task(task_struct *task, wait_queue_head *head);
 
 task_struct *wq_get_first_task(wait_queue_head *head);
 
@@ -1,6 +1,8 @@
 #ifndef _BITOPS_H
 #define _BITOPS_H
 
+#include <types.h>
+
 // Find First bit Set
 #define ffs(x) __builtin_ffs(x)
 
@@ -9,4 +11,19 @@ static inline int fls(unsigned int x)
     return x ? sizeof(x) * 8 - __builtin_clz(x) : 0;
 }
 
+static inline void set_bit(uint64 *map, uint32 nr)
+{
+    map[nr / 64] |= (uint64)1 << (nr % 64);
+}
+
+static inline void clear_bit(uint64 *map, uint32 nr)
+{
+    map[nr / 64] &= ~((uint64)1 << (nr % 64));
+}
+
+static inline int test_bit(uint64 *map, uint32 nr)
+{
+    return (map[nr / 64] >> (nr % 64)) & 1;
+}
+
 #endif
\ No newline at end of file
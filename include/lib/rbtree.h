@@ -0,0 +1,89 @@
+/* Linux-like red-black tree implementation */
+#ifndef _RBTREE_H
+#define _RBTREE_H
+
+#include <types.h>
+#include <list.h>
+
+#define RB_RED      0
+#define RB_BLACK    1
+
+/**
+ * struct rb_node - Node of a red-black tree, embedded in the entry
+ * @parent: parent node, NULL for the root
+ * @left: left child, the entries before this one
+ * @right: right child, the entries after this one
+ * @color: RB_RED or RB_BLACK
+ */
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+};
+
+/**
+ * struct rb_root - Root of a red-black tree
+ * @node: root node, NULL for an empty tree
+ */
+struct rb_root {
+    struct rb_node *node;
+};
+
+#define RB_ROOT (struct rb_root) { NULL, }
+
+#define rb_entry(node, type, member) container_of(node, type, member)
+
+/**
+ * rb_augment_f - Recompute the augmented value of @node from the node itself
+ * and its children, e.g. the maximum of a field in the subtree of @node.
+ */
+typedef void (*rb_augment_f)(struct rb_node *node);
+
+/**
+ * rb_link_node() - Link @node as the leaf @link of @parent
+ *
+ * The caller searches the position of the new entry from the root, then
+ * calls rb_insert_color() to rebalance the tree.
+ */
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+                                struct rb_node **link)
+{
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color = RB_RED;
+
+    *link = node;
+}
+
+/**
+ * rb_propagate() - Recompute the augmented values from @node up to the root
+ */
+static inline void rb_propagate(struct rb_node *node, rb_augment_f augment)
+{
+    for (; node; node = node->parent) {
+        augment(node);
+    }
+}
+
+/*
+ * Rebalance the tree after rb_link_node(). @augment can be NULL, otherwise
+ * the augmented values must be up to date (see rb_propagate()) and are
+ * maintained across the rotations.
+ */
+void rb_insert_color(struct rb_node *node, struct rb_root *root,
+                     rb_augment_f augment);
+
+/*
+ * Remove @node from the tree. @augment can be NULL, otherwise the augmented
+ * values of the remaining nodes are updated.
+ */
+void rb_erase(struct rb_node *node, struct rb_root *root,
+              rb_augment_f augment);
+
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_last(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_prev(const struct rb_node *node);
+
+#endif /* _RBTREE_H */
@@ -12,6 +12,16 @@ uint32 get32(uint64 addr);
 void memzero(char *src, uint64 n);
 void memncpy(char *dst, const char *src, uint64 n);
 void memset(void *ptr, uint8 value, uint64 num);
+/*
+ * Same as memncpy(), but @dst and @src may overlap.
+ */
+void memmove(void *dst, const void *src, uint64 n);
+
+/*
+ * Zero the PAGE_SIZE aligned @page with DC ZVA, a cache line at a time.
+ * Falls back to memzero() if DC ZVA is prohibited (DCZID_EL0.DZP).
+ */
+void clear_page(void *page);
 
 #endif /* __ASSEMBLER__ */
 
@@ -37,16 +47,16 @@ void memset(void *ptr, uint8 value, uint64 num);
     asm volatile("msr DAIFSet, 0xf"); \
 } while (0)
 
-#define set_page_table(page_table) do {         \
+/*
+ * Load @ttbr (PA of the page table | ASID << 48) into TTBR0. The TLB isn't
+ * flushed, the entries are tagged with the ASID, see switch_mm().
+ */
+#define set_page_table(ttbr) do {               \
     asm volatile(                               \
-        "mov x9, %0\n"                          \
-        "and x9, x9, #0x0000ffffffffffff\n"     \
-        "dsb ish\n"                             \
-        "msr ttbr0_el1, x9\n"                   \
-        "tlbi vmalle1is\n"                      \
         "dsb ish\n"                             \
+        "msr ttbr0_el1, %0\n"                   \
         "isb\n"                                 \
-        :: "r" (page_table)                     \
+        :: "r" (ttbr)                           \
     );                                          \
 } while (0)
 
@@ -77,6 +87,7 @@ static inline void restore_interrupt(uint32 daif)
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
 #define ALIGN(num, base) ((num + base - 1) & ~(base - 1))
+#define ALIGN_DOWN(num, base) ((num) & ~((base) - 1))
 
 #define TO_CHAR_PTR(a) ((char *)(uint64)(a))
 
@@ -0,0 +1,286 @@
+#include <asid.h>
+#include <task.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <bitops.h>
+#include <utils.h>
+
+#define ASID_FIRST_GENERATION   ((uint64)1 << ASID_FIELD_BITS)
+
+static uint32 asid_bits;
+
+/* Generation of the ASIDs handed out now */
+static uint64 asid_generation = ASID_FIRST_GENERATION;
+
+/* Bit n is set if ASID n is used in the current generation */
+static uint64 asid_map[(1 << ASID_FIELD_BITS) / 64];
+
+/* Where to start looking for a free ASID */
+static uint32 asid_next = 1;
+
+/* context_id of the task running on each core */
+static uint64 active_asids[NR_CPUS];
+
+/*
+ * The ASIDs still used by the running tasks when the generation was rolled
+ * over, they are carried into the new generation.
+ */
+static uint64 reserved_asids[NR_CPUS];
+
+/* Protects all of the above */
+static spinlock_t asid_lock = SPINLOCK_INIT("asid");
+
+void asid_init(void)
+{
+    // ID_AA64MMFR0_EL1.ASIDBits, see mmu_enable()
+    if (((read_sysreg(ID_AA64MMFR0_EL1) >> 4) & 0xf) == 0b0010) {
+        asid_bits = 16;
+    } else {
+        asid_bits = 8;
+    }
+
+    // ASID 0 is used by the boot page table
+    set_bit(asid_map, 0);
+}
+
+/*
+ * Larger ranges are flushed with the whole TLB, or all the entries of the
+ * ASID for a user range
+ */
+#define FLUSH_MAX_PAGES 64
+
+static inline void local_flush_tlb_all(void)
+{
+    asm volatile(
+        "dsb nshst\n"
+        "tlbi vmalle1\n"
+        "dsb nsh\n"
+        "isb\n"
+    );
+}
+
+static inline void flush_tlb_all(void)
+{
+    asm volatile(
+        "dsb ishst\n"
+        "tlbi vmalle1is\n"
+        "dsb ish\n"
+        "isb\n"
+    );
+}
+
+/*
+ * Start a new generation. The ASIDs running on each core are reserved, the
+ * others are freed.
+ * Must be called with @asid_lock held.
+ */
+static void flush_context(void)
+{
+    for (int i = 0; i < ARRAY_SIZE(asid_map); ++i) {
+        asid_map[i] = 0;
+    }
+
+    set_bit(asid_map, 0);
+
+    for (int cpu = 0; cpu < NR_CPUS; ++cpu) {
+        uint64 ctx = active_asids[cpu];
+
+        // Keep the reserved ASID of a core which hasn't switched since
+        if (!ctx) {
+            ctx = reserved_asids[cpu];
+        }
+
+        if (ctx) {
+            set_bit(asid_map, context_asid(ctx));
+        }
+
+        reserved_asids[cpu] = ctx;
+    }
+
+    asid_generation += ASID_FIRST_GENERATION;
+    asid_next = 1;
+
+    // Drop the TLB entries of all the freed ASIDs at once
+    flush_tlb_all();
+}
+
+/*
+ * Return the ASID of @ctx if it was reserved by flush_context(), updated
+ * to the current generation. Return 0 otherwise.
+ * Must be called with @asid_lock held.
+ */
+static uint64 check_reserved_asid(uint64 ctx)
+{
+    uint64 new_ctx = 0;
+
+    for (int cpu = 0; cpu < NR_CPUS; ++cpu) {
+        if (reserved_asids[cpu] == ctx) {
+            new_ctx = asid_generation | context_asid(ctx);
+            reserved_asids[cpu] = new_ctx;
+        }
+    }
+
+    return new_ctx;
+}
+
+static uint32 find_free_asid(uint32 from)
+{
+    uint32 nr = 1 << asid_bits;
+
+    for (uint32 asid = from; asid < nr; ) {
+        uint64 word = asid_map[asid / 64];
+
+        if (word == ~(uint64)0) {
+            asid = ALIGN(asid + 1, 64);
+            continue;
+        }
+
+        // Skip the bits below @asid in the first word
+        word |= ((uint64)1 << (asid % 64)) - 1;
+
+        if (word != ~(uint64)0) {
+            return (asid & ~63) + __builtin_ctzll(~word);
+        }
+
+        asid = ALIGN(asid + 1, 64);
+    }
+
+    return 0;
+}
+
+/*
+ * Must be called with @asid_lock held.
+ */
+static uint64 new_context(uint64 ctx)
+{
+    uint64 new_ctx;
+    uint32 asid;
+
+    if (ctx) {
+        new_ctx = check_reserved_asid(ctx);
+
+        if (new_ctx) {
+            return new_ctx;
+        }
+
+        // Keep the same ASID if it hasn't been taken in this generation
+        asid = context_asid(ctx);
+
+        if (!test_bit(asid_map, asid)) {
+            set_bit(asid_map, asid);
+            return asid_generation | asid;
+        }
+    }
+
+    asid = find_free_asid(asid_next);
+
+    if (!asid) {
+        flush_context();
+        asid = find_free_asid(asid_next);
+    }
+
+    set_bit(asid_map, asid);
+    asid_next = asid + 1;
+
+    return asid_generation | asid;
+}
+
+void switch_mm(task_struct *prev, task_struct *next)
+{
+    uint64 ttbr0;
+    uint64 old_ttbr0;
+    int cpu;
+
+    cpu = smp_processor_id();
+
+    spin_lock(&asid_lock);
+
+    if ((next->context_id ^ asid_generation) >> ASID_FIELD_BITS) {
+        next->context_id = new_context(next->context_id);
+    }
+
+    active_asids[cpu] = next->context_id;
+
+    spin_unlock(&asid_lock);
+
+    ttbr0 = VA2PA(next->page_table) |
+            (context_asid(next->context_id) << 48);
+    old_ttbr0 = read_sysreg(TTBR0_EL1);
+
+    if (ttbr0 == old_ttbr0) {
+        return;
+    }
+
+    set_page_table(ttbr0);
+
+    if (!context_asid(old_ttbr0 >> 48)) {
+        // Leaving the boot page table, whose identity mapping is global
+        local_flush_tlb_all();
+    }
+}
+
+void flush_tlb_mm(task_struct *task)
+{
+    asm volatile(
+        "dsb ishst\n"
+        "tlbi aside1is, %0\n"
+        "dsb ish\n"
+        "isb\n"
+        :: "r" (context_asid(task->context_id) << 48)
+    );
+}
+
+void flush_tlb_page(task_struct *task, uint64 va)
+{
+    asm volatile(
+        "dsb ishst\n"
+        "tlbi vae1is, %0\n"
+        "dsb ish\n"
+        "isb\n"
+        :: "r" ((context_asid(task->context_id) << 48) | (va >> 12))
+    );
+}
+
+void flush_tlb_range(task_struct *task, uint64 start, uint64 end)
+{
+    uint64 asid;
+
+    if ((end - start) / PAGE_SIZE > FLUSH_MAX_PAGES) {
+        flush_tlb_mm(task);
+        return;
+    }
+
+    asid = context_asid(task->context_id) << 48;
+
+    asm volatile("dsb ishst");
+
+    for (uint64 va = start; va < end; va += PAGE_SIZE) {
+        asm volatile("tlbi vae1is, %0" :: "r" (asid | (va >> 12)));
+    }
+
+    asm volatile(
+        "dsb ish\n"
+        "isb\n"
+    );
+}
+
+void flush_tlb_kernel_range(uint64 start, uint64 end)
+{
+    if ((end - start) / PAGE_SIZE > FLUSH_MAX_PAGES) {
+        flush_tlb_all();
+        return;
+    }
+
+    asm volatile("dsb ishst");
+
+    for (uint64 va = start; va < end; va += PAGE_SIZE) {
+        // VA[55:12], for any ASID
+        asm volatile("tlbi vaale1is, %0"
+                     :: "r" ((va >> 12) & 0xfffffffffffULL));
+    }
+
+    asm volatile(
+        "dsb ish\n"
+        "isb\n"
+    );
+}
@@ -3,6 +3,10 @@
 #include <syscall.h>
 #include <mmu.h>
 #include <panic.h>
+#include <smp.h>
+#include <sched.h>
+#include <current.h>
+#include <utils.h>
 
 void el0_sync_handler(trapframe *regs, uint32 syn)
 {
@@ -10,6 +14,15 @@ void el0_sync_handler(trapframe *regs, uint32 syn)
       
     esr = (esr_el1_t *)&syn;
 
+    lock_kernel();
+
+    if (current->status == TASK_DEAD) {
+        // Killed by another core, it has been removed from the run queue
+        schedule();
+
+        // Never reach
+    }
+
     switch (esr->ec) {
     case EC_SVC_64:
         syscall_handler(regs);
@@ -22,4 +35,28 @@ void el0_sync_handler(trapframe *regs, uint32 syn)
         show_trapframe(regs);
         panic("esr->ec: %x", esr->ec);
     }
+
+    unlock_kernel();
+}
+
+void el1_sync_handler(trapframe *regs, uint32 syn)
+{
+    esr_el1_t *esr;
+    uint64 far;
+
+    esr = (esr_el1_t *)&syn;
+    far = read_sysreg(FAR_EL1);
+
+    // The kernel accesses the user memory on behalf of a syscall, e.g. it
+    // writes a copy-on-write page
+    if (esr->ec == EC_DA_CE && far <= 0x0000ffffffffffff && current &&
+        current->address_space) {
+        lock_kernel();
+        mem_abort(esr);
+        unlock_kernel();
+        return;
+    }
+
+    show_trapframe(regs);
+    panic("el1 esr->ec: %x, far: %llx", esr->ec, far);
 }
\ No newline at end of file
@@ -37,7 +37,7 @@ static inline void pt_regs_init(struct pt_regs *regs)
 // TODO: Add argv & envp
 void sched_new_user_prog(char *pathname)
 {
-    void *data;
+    struct vnode *vnode;
     int datalen, adj_datalen;
     task_struct *task;
     struct file f;
@@ -49,30 +49,20 @@ void sched_new_user_prog(char *pathname)
         return;
     }
 
-    datalen = f.vnode->v_ops->getsize(f.vnode);
+    vnode = f.vnode;
+    datalen = vnode->v_ops->getsize(vnode);
 
-    if (datalen < 0) {
-        return;
-    }
-
-    adj_datalen = ALIGN(datalen, PAGE_SIZE);
-
-    data = kmalloc(adj_datalen);
-
-    memzero(data, adj_datalen);
-
-    ret = vfs_read(&f, data, datalen);
+    vfs_close(&f);
 
-    if (ret < 0) {
-        kfree(data);
+    if (datalen < 0 || !vnode->v_ops->readpage) {
         return;
     }
 
-    vfs_close(&f);
+    adj_datalen = ALIGN(datalen, PAGE_SIZE);
 
     task = task_create();
 
-    task->kernel_stack = kmalloc(STACK_SIZE);
+    task->kernel_stack = vmalloc(STACK_SIZE);
 
     task->regs.sp = (char *)task->kernel_stack + STACK_SIZE - 0x10;
     pt_regs_init(&task->regs);
@@ -80,8 +70,9 @@ void sched_new_user_prog(char *pathname)
     task_init_map(task);
 
     // 0x000000000000 ~ <adj_datalen>: rwx: Code
+    // The image is read from @vnode page by page on the first access
     vma_map(task->address_space, (void *)0, adj_datalen,
-           VMA_R | VMA_W | VMA_X | VMA_KVA, data);
+           VMA_R | VMA_W | VMA_X | VMA_FILE, vnode);
 
     sched_add_task(task);
 }
@@ -74,6 +74,8 @@ static int cpiofs_mkdir(struct vnode *dir_node, struct vnode **target,
 static int cpiofs_isdir(struct vnode *dir_node);
 static int cpiofs_getname(struct vnode *dir_node, const char **name);
 static int cpiofs_getsize(struct vnode *dir_node);
+static int cpiofs_readpage(struct vnode *file_node, void *page,
+                           uint64 offset);
 
 static struct vnode_operations cpiofs_v_ops = {
     .lookup = cpiofs_lookup,
@@ -81,7 +83,8 @@ static struct vnode_operations cpiofs_v_ops = {
     .mkdir = cpiofs_mkdir,
     .isdir = cpiofs_isdir,
     .getname = cpiofs_getname,
-    .getsize = cpiofs_getsize
+    .getsize = cpiofs_getsize,
+    .readpage = cpiofs_readpage
 };
 
 static int cpiofs_write(struct file *file, const void *buf, size_t len);
@@ -223,6 +226,31 @@ static int cpiofs_getsize(struct vnode *dir_node)
     return internal->file.size;
 }
 
+static int cpiofs_readpage(struct vnode *file_node, void *page, uint64 offset)
+{
+    struct cpiofs_internal *internal;
+    int len;
+
+    internal = file_node->internal;
+
+    if (internal->type != CPIOFS_TYPE_FILE) {
+        return -1;
+    }
+
+    if (offset >= internal->file.size) {
+        len = 0;
+    } else if (internal->file.size - offset > PAGE_SIZE) {
+        len = PAGE_SIZE;
+    } else {
+        len = internal->file.size - offset;
+    }
+
+    memncpy(page, &internal->file.data[offset], len);
+    memzero((char *)page + len, PAGE_SIZE - len);
+
+    return 0;
+}
+
 /* file_operations methods */
 
 static int cpiofs_write(struct file *file, const void *buf, size_t len)
@@ -443,7 +471,7 @@ static void cpio_init_mkdir(const char *pathname)
     }
 
     internal = kmalloc(sizeof(struct cpiofs_internal));
-    newdir_node = kmalloc(sizeof(struct vnode));
+    newdir_node = kmem_cache_alloc(vnode_cache);
 
     internal->name = curname;
     internal->type = CPIOFS_TYPE_DIR;
@@ -487,7 +515,7 @@ static void cpio_init_create(const char *pathname,
     }
 
     internal = kmalloc(sizeof(struct cpiofs_internal));
-    newdir_node = kmalloc(sizeof(struct vnode));
+    newdir_node = kmem_cache_alloc(vnode_cache);
 
     internal->name = curname;
     internal->type = CPIOFS_TYPE_FILE;
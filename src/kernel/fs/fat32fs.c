@@ -170,6 +170,9 @@ struct fat_mount_t {
 /* Head of fat_mount_t chain */
 static struct list_head mounts;
 
+static struct kmem_cache *fat_internal_cache;
+static struct kmem_cache *fat_block_cache;
+
 static int fat32fs_mount(struct filesystem *fs, struct mount *mount);
 static int fat32fs_sync(struct filesystem *fs);
 
@@ -188,6 +191,10 @@ static int fat32fs_mkdir(struct vnode *dir_node, struct vnode **target,
 static int fat32fs_isdir(struct vnode *dir_node);
 static int fat32fs_getname(struct vnode *dir_node, const char **name);
 static int fat32fs_getsize(struct vnode *dir_node);
+static int fat32fs_readpage(struct vnode *file_node, void *page,
+                            uint64 offset);
+static int fat32fs_writepage(struct vnode *file_node, const void *page,
+                             uint64 offset);
 
 static struct vnode_operations fat32fs_v_ops = {
     .lookup = fat32fs_lookup,
@@ -195,7 +202,9 @@ static struct vnode_operations fat32fs_v_ops = {
     .mkdir = fat32fs_mkdir,
     .isdir = fat32fs_isdir,
     .getname = fat32fs_getname,
-    .getsize = fat32fs_getsize
+    .getsize = fat32fs_getsize,
+    .readpage = fat32fs_readpage,
+    .writepage = fat32fs_writepage
 };
 
 static int fat32fs_write(struct file *file, const void *buf, size_t len);
@@ -252,8 +261,8 @@ static int fat32fs_mount(struct filesystem *fs, struct mount *mount)
 
     sd_readblock(partition[0].lba, buf);
 
-    node = kmalloc(sizeof(struct vnode));
-    data = kmalloc(sizeof(struct fat_internal));
+    node = kmem_cache_alloc(vnode_cache);
+    data = kmem_cache_alloc(fat_internal_cache);
     fat = kmalloc(sizeof(struct fat_info_t));
     dir = kmalloc(sizeof(struct fat_dir_t));
     newmount = kmalloc(sizeof(struct fat_mount_t));
@@ -688,8 +697,8 @@ static struct vnode *_create_vnode(struct vnode *parent,
     len = strlen(name);
 
     buf = kmalloc(len + 1);
-    node = kmalloc(sizeof(struct vnode));
-    data = kmalloc(sizeof(struct fat_internal));
+    node = kmem_cache_alloc(vnode_cache);
+    data = kmem_cache_alloc(fat_internal_cache);
 
     strcpy(buf, name);
 
@@ -1085,7 +1094,7 @@ static int _writefile_seek_fat32(struct fat_internal *data,
     while (1) {
         struct fat_file_block_t *newblock;
 
-        newblock = kmalloc(sizeof(struct fat_file_block_t));
+        newblock = kmem_cache_alloc(fat_block_cache);
 
         newblock->oid = curoid;
         newblock->cid = curcid;
@@ -1145,7 +1154,7 @@ static int _writefile_fat32(struct fat_internal *data, uint64 bckoff,
     head = &data->file->list;
     info = data->fat;
 
-    block = kmalloc(sizeof(struct fat_file_block_t));
+    block = kmem_cache_alloc(fat_block_cache);
 
     wsize = size > BLOCK_SIZE - bckoff ? BLOCK_SIZE - bckoff : size;
 
@@ -1322,7 +1331,7 @@ static int _readfile_seek_fat32(struct fat_internal *data,
     while (1) {
         struct fat_file_block_t *newblock;
 
-        newblock = kmalloc(sizeof(struct fat_file_block_t));
+        newblock = kmem_cache_alloc(fat_block_cache);
 
         newblock->oid = curoid;
         newblock->cid = curcid;
@@ -1386,7 +1395,7 @@ static int _readfile_fat32(struct fat_internal *data, uint64 bckoff,
     head = &data->file->list;
     info = data->fat;
 
-    block = kmalloc(sizeof(struct fat_file_block_t));
+    block = kmem_cache_alloc(fat_block_cache);
 
     rsize = size > BLOCK_SIZE - bckoff ? BLOCK_SIZE - bckoff : size;
     lba = info->cluster_lba + (cid - 2) * info->bs.sector_per_cluster;
@@ -1508,6 +1517,80 @@ static int fat32fs_read(struct file *file, void *buf, size_t len)
     return ret;
 }
 
+/*
+ * Return the number of bytes of the page at @offset within the file.
+ */
+static int _page_len(struct vnode *file_node, uint64 offset)
+{
+    int filesize;
+
+    filesize = fat32fs_getsize(file_node);
+
+    if (offset >= filesize) {
+        return 0;
+    }
+
+    if (filesize - offset > PAGE_SIZE) {
+        return PAGE_SIZE;
+    }
+
+    return filesize - offset;
+}
+
+static int fat32fs_readpage(struct vnode *file_node, void *page,
+                            uint64 offset)
+{
+    int len;
+    int ret;
+
+    if (fat32fs_isdir(file_node)) {
+        return -1;
+    }
+
+    len = _page_len(file_node, offset);
+
+    if (len) {
+        ret = _readfile(page, file_node->internal, offset, len);
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    memzero((char *)page + len, PAGE_SIZE - len);
+
+    return 0;
+}
+
+/*
+ * The page goes to the block cache, it reaches the SD card with
+ * fat32fs_sync().
+ */
+static int fat32fs_writepage(struct vnode *file_node, const void *page,
+                             uint64 offset)
+{
+    int len;
+    int ret;
+
+    if (fat32fs_isdir(file_node)) {
+        return -1;
+    }
+
+    len = _page_len(file_node, offset);
+
+    if (!len) {
+        return 0;
+    }
+
+    ret = _writefile(page, file_node->internal, offset, len);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    return 0;
+}
+
 static int fat32fs_open(struct vnode *file_node, struct file *target)
 {
     target->vnode = file_node;
@@ -1665,5 +1748,12 @@ struct filesystem *fat32fs_init(void)
 {
     INIT_LIST_HEAD(&mounts);
 
+    fat_internal_cache = kmem_cache_create("fat_internal",
+                                           sizeof(struct fat_internal),
+                                           8, NULL);
+    fat_block_cache = kmem_cache_create("fat_file_block_t",
+                                        sizeof(struct fat_file_block_t),
+                                        8, NULL);
+
     return &fat32fs;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <rpi3.h>
 #include <preempt.h>
 #include <utils.h>
+#include <cache.h>
 
 static uint32 __attribute__((aligned(0x10))) mbox[36];
 
@@ -163,6 +164,9 @@ static int fbfs_write(struct file *file, const void *buf, size_t len)
 
     memncpy((void *)(internal->lfb + file->f_pos), buf, len);
 
+    // Make the frame visible to the VideoCore
+    dcache_clean_range(internal->lfb + file->f_pos, len);
+
     file->f_pos += len;
 
     return len;
@@ -54,6 +54,10 @@ static int tmpfs_mkdir(struct vnode *dir_node, struct vnode **target,
 static int tmpfs_isdir(struct vnode *dir_node);
 static int tmpfs_getname(struct vnode *dir_node, const char **name);
 static int tmpfs_getsize(struct vnode *dir_node);
+static int tmpfs_readpage(struct vnode *file_node, void *page,
+                          uint64 offset);
+static int tmpfs_writepage(struct vnode *file_node, const void *page,
+                           uint64 offset);
 
 static struct vnode_operations tmpfs_v_ops = {
     .lookup = tmpfs_lookup,
@@ -61,7 +65,9 @@ static struct vnode_operations tmpfs_v_ops = {
     .mkdir = tmpfs_mkdir,
     .isdir = tmpfs_isdir,
     .getname = tmpfs_getname,
-    .getsize = tmpfs_getsize
+    .getsize = tmpfs_getsize,
+    .readpage = tmpfs_readpage,
+    .writepage = tmpfs_writepage
 };
 
 static int tmpfs_write(struct file *file, const void *buf, size_t len);
@@ -97,7 +103,7 @@ static int tmpfs_mount(struct filesystem *fs, struct mount *mount)
         return -1;
     }
 
-    node = kmalloc(sizeof(struct vnode));
+    node = kmem_cache_alloc(vnode_cache);
     internal = kmalloc(sizeof(struct tmpfs_internal));
     dir = kmalloc(sizeof(struct tmpfs_dir_t));
 
@@ -127,7 +133,7 @@ static int tmpfs_alloc_vnode(struct filesystem *fs, struct vnode **target)
     struct tmpfs_internal *internal;
     struct tmpfs_dir_t *dir;
 
-    node = kmalloc(sizeof(struct vnode));
+    node = kmem_cache_alloc(vnode_cache);
     internal = kmalloc(sizeof(struct tmpfs_internal));
     dir = kmalloc(sizeof(struct tmpfs_dir_t));
 
@@ -228,7 +234,7 @@ static int tmpfs_create(struct vnode *dir_node, struct vnode **target,
         return -1;
     }
 
-    node = kmalloc(sizeof(struct vnode));
+    node = kmem_cache_alloc(vnode_cache);
     newint = kmalloc(sizeof(struct tmpfs_internal));
     file = kmalloc(sizeof(struct tmpfs_file_t));
 
@@ -285,7 +291,7 @@ static int tmpfs_mkdir(struct vnode *dir_node, struct vnode **target,
         return -1;
     }
 
-    node = kmalloc(sizeof(struct vnode));
+    node = kmem_cache_alloc(vnode_cache);
     newint = kmalloc(sizeof(struct tmpfs_internal));
     newdir = kmalloc(sizeof(struct tmpfs_dir_t));
 
@@ -347,6 +353,60 @@ static int tmpfs_getsize(struct vnode *dir_node)
     return internal->file->size;
 }
 
+/*
+ * Return the number of bytes of the page at @offset within the file.
+ */
+static int tmpfs_page_len(struct tmpfs_file_t *f, uint64 offset)
+{
+    if (offset >= f->size) {
+        return 0;
+    }
+
+    if (f->size - offset > PAGE_SIZE) {
+        return PAGE_SIZE;
+    }
+
+    return f->size - offset;
+}
+
+static int tmpfs_readpage(struct vnode *file_node, void *page, uint64 offset)
+{
+    struct tmpfs_internal *internal;
+    int len;
+
+    internal = file_node->internal;
+
+    if (internal->type != TMPFS_TYPE_FILE) {
+        return -1;
+    }
+
+    len = tmpfs_page_len(internal->file, offset);
+
+    memncpy(page, &internal->file->data[offset], len);
+    memzero((char *)page + len, PAGE_SIZE - len);
+
+    return 0;
+}
+
+static int tmpfs_writepage(struct vnode *file_node, const void *page,
+                           uint64 offset)
+{
+    struct tmpfs_internal *internal;
+    int len;
+
+    internal = file_node->internal;
+
+    if (internal->type != TMPFS_TYPE_FILE) {
+        return -1;
+    }
+
+    len = tmpfs_page_len(internal->file, offset);
+
+    memncpy(&internal->file->data[offset], page, len);
+
+    return 0;
+}
+
 /* file_operations methods */
 
 static int tmpfs_write(struct file *file, const void *buf, size_t len)
@@ -5,11 +5,46 @@
 #include <current.h>
 #include <task.h>
 #include <panic.h>
+#include <cache.h>
 
 struct mount *rootmount;
 
+struct kmem_cache *vnode_cache;
+
 static struct list_head filesystems;
 
+/*
+ * The pages of the mapped files (program images too), see vfs_getpage():
+ * the shared mappings and write() write to them, the private mappings
+ * copy them on the first write. Each cached page holds a page_refs
+ * reference of its own, the pages no longer mapped are dropped when memory
+ * runs out, see vfs_shrink_page_cache(). The pages are movable, compaction
+ * may replace them, see vfs_replace_cached_pages().
+ */
+struct page_cache {
+    /* Link all page caches, for the shrinker and compaction */
+    struct list_head list;
+    struct vnode *vnode;
+    uint32 nr_pages;
+    void **pages;
+};
+
+static struct list_head page_caches;
+static struct kmem_cache *page_cache_cache;
+
+static uint32 nr_cached_pages;
+static uint32 nr_page_cache_hits;
+static uint32 nr_page_cache_shrunk;
+
+/*
+ * The filesystems set up the rest of their vnodes. Vnodes are never freed,
+ * so constructing a chunk once is enough to start with no page cache.
+ */
+static void vnode_ctor(void *node)
+{
+    ((struct vnode *)node)->page_cache = NULL;
+}
+
 /*
  * Return directory vnode, and set @pathname to the last component name.
  * If the @pathname is end with '/', set @pathname to NULL
@@ -107,6 +142,14 @@ static struct filesystem *find_filesystem(const char *filesystem)
 void vfs_init(void)
 {
     INIT_LIST_HEAD(&filesystems);
+
+    vnode_cache = kmem_cache_create("vnode", sizeof(struct vnode), 8,
+                                    vnode_ctor);
+
+    INIT_LIST_HEAD(&page_caches);
+
+    page_cache_cache = kmem_cache_create("page_cache",
+                                         sizeof(struct page_cache), 8, NULL);
 }
 
 void vfs_init_rootmount(struct filesystem *fs)
@@ -189,9 +232,57 @@ int vfs_close(struct file *file)
     return file->f_ops->close(file);
 }
 
+/*
+ * Copy the @len bytes written at @pos of @node into the cached pages, the
+ * mappings keep seeing the file as it is.
+ */
+static void page_cache_write(struct vnode *node, const char *buf,
+                             uint64 pos, uint64 len)
+{
+    struct page_cache *pc;
+    char *page;
+    uint64 off, n;
+
+    pc = node->page_cache;
+
+    if (!pc) {
+        return;
+    }
+
+    // The pages past the end of the cache are read in when mapped
+    while (len && pos / PAGE_SIZE < pc->nr_pages) {
+        off = pos % PAGE_SIZE;
+        n = PAGE_SIZE - off < len ? PAGE_SIZE - off : len;
+
+        page = pc->pages[pos / PAGE_SIZE];
+
+        if (page) {
+            memncpy(page + off, buf, n);
+
+            // The page may be mapped executable
+            icache_sync_range(page + off, n);
+        }
+
+        pos += n;
+        buf += n;
+        len -= n;
+    }
+}
+
 int vfs_write(struct file *file, const void *buf, size_t len)
 {
-    return file->f_ops->write(file, buf, len);
+    size_t pos;
+    int ret;
+
+    pos = file->f_pos;
+
+    ret = file->f_ops->write(file, buf, len);
+
+    if (ret > 0) {
+        page_cache_write(file->vnode, buf, pos, ret);
+    }
+
+    return ret;
 }
 
 int vfs_read(struct file *file, void *buf, size_t len)
@@ -326,6 +417,266 @@ int vfs_sync(struct filesystem *fs)
     return fs->sync(fs);
 }
 
+int vfs_sync_all(void)
+{
+    struct filesystem *entry;
+
+    list_for_each_entry(entry, &filesystems, fs_list) {
+        vfs_sync(entry);
+    }
+
+    return 0;
+}
+
+int vfs_readpage(struct vnode *node, void *page, uint64 offset)
+{
+    if (!node->v_ops->readpage) {
+        return -1;
+    }
+
+    return node->v_ops->readpage(node, page, offset);
+}
+
+int vfs_writepage(struct vnode *node, const void *page, uint64 offset)
+{
+    if (!node->v_ops->writepage) {
+        return -1;
+    }
+
+    // @page is the cached page of a shared mapping, the cache stays valid
+    return node->v_ops->writepage(node, page, offset);
+}
+
+static struct page_cache *page_cache_create(struct vnode *node)
+{
+    struct page_cache *pc;
+    int size;
+
+    size = node->v_ops->getsize(node);
+
+    if (size <= 0) {
+        return NULL;
+    }
+
+    pc = kmem_cache_alloc(page_cache_cache);
+
+    if (!pc) {
+        return NULL;
+    }
+
+    pc->vnode = node;
+    pc->nr_pages = ALIGN(size, PAGE_SIZE) / PAGE_SIZE;
+    pc->pages = kmalloc(pc->nr_pages * sizeof(void *));
+
+    if (!pc->pages) {
+        kmem_cache_free(page_cache_cache, pc);
+        return NULL;
+    }
+
+    memzero((char *)pc->pages, pc->nr_pages * sizeof(void *));
+
+    list_add(&pc->list, &page_caches);
+    node->page_cache = pc;
+
+    return pc;
+}
+
+/*
+ * Cover the file with @pc again after the file has grown, the pages past
+ * the new size stay uncached if that fails.
+ */
+static void page_cache_grow(struct page_cache *pc)
+{
+    void **pages;
+    uint32 nr_pages;
+    int size;
+
+    size = pc->vnode->v_ops->getsize(pc->vnode);
+
+    if (size <= 0 || ALIGN(size, PAGE_SIZE) / PAGE_SIZE <= pc->nr_pages) {
+        return;
+    }
+
+    nr_pages = ALIGN(size, PAGE_SIZE) / PAGE_SIZE;
+
+    // Out of the shrinker's reach while allocating
+    list_del(&pc->list);
+
+    pages = kmalloc(nr_pages * sizeof(void *));
+
+    list_add(&pc->list, &page_caches);
+
+    if (!pages) {
+        return;
+    }
+
+    memncpy((char *)pages, (char *)pc->pages, pc->nr_pages * sizeof(void *));
+    memzero((char *)(pages + pc->nr_pages),
+            (nr_pages - pc->nr_pages) * sizeof(void *));
+
+    kfree(pc->pages);
+
+    pc->pages = pages;
+    pc->nr_pages = nr_pages;
+}
+
+void *vfs_findpage(struct vnode *node, uint64 offset)
+{
+    struct page_cache *pc;
+    void *page;
+
+    pc = node->page_cache;
+
+    if (!pc || offset / PAGE_SIZE >= pc->nr_pages) {
+        return NULL;
+    }
+
+    page = pc->pages[offset / PAGE_SIZE];
+
+    if (page) {
+        page_ref_inc(page);
+        nr_page_cache_hits++;
+    }
+
+    return page;
+}
+
+void *vfs_getpage(struct vnode *node, uint64 offset)
+{
+    struct page_cache *pc;
+    void *page;
+
+    page = vfs_findpage(node, offset);
+
+    if (page) {
+        return page;
+    }
+
+    // Straight from the Buddy System, so the shrinker gives it back there
+    page = alloc_page_movable();
+
+    if (!page) {
+        return NULL;
+    }
+
+    if (vfs_readpage(node, page, offset) < 0) {
+        free_page(page);
+        return NULL;
+    }
+
+    // The page may be mapped executable
+    icache_sync_range(page, PAGE_SIZE);
+
+    page_ref_init(page);
+
+    pc = node->page_cache;
+
+    if (!pc) {
+        pc = page_cache_create(node);
+    } else if (offset / PAGE_SIZE >= pc->nr_pages) {
+        // Written past the end since the cache was created
+        page_cache_grow(pc);
+    }
+
+    // The pages beyond the end of the file aren't cached
+    if (pc && offset / PAGE_SIZE < pc->nr_pages) {
+        pc->pages[offset / PAGE_SIZE] = page;
+        page_ref_inc(page);
+        nr_cached_pages++;
+    }
+
+    return page;
+}
+
+int vfs_shrink_page_cache(void)
+{
+    struct page_cache *pc, *tmp;
+    int freed = 0;
+
+    list_for_each_entry_safe(pc, tmp, &page_caches, list) {
+        uint32 left = 0;
+
+        for (uint32 i = 0; i < pc->nr_pages; ++i) {
+            if (!pc->pages[i]) {
+                continue;
+            }
+
+            // Only the reference of the cache is left
+            if (page_ref_count(pc->pages[i]) != 1) {
+                left++;
+                continue;
+            }
+
+            page_ref_dec(pc->pages[i]);
+            free_page(pc->pages[i]);
+
+            pc->pages[i] = NULL;
+            nr_cached_pages--;
+            freed++;
+        }
+
+        if (!left) {
+            list_del(&pc->list);
+            pc->vnode->page_cache = NULL;
+
+            kfree(pc->pages);
+            kmem_cache_free(page_cache_cache, pc);
+        }
+    }
+
+    nr_page_cache_shrunk += freed;
+
+    return freed;
+}
+
+void vfs_count_cached_pages(void **pages, uint32 *refs, int n)
+{
+    struct page_cache *pc;
+
+    list_for_each_entry(pc, &page_caches, list) {
+        for (uint32 i = 0; i < pc->nr_pages; ++i) {
+            if (!pc->pages[i]) {
+                continue;
+            }
+
+            for (int j = 0; j < n; ++j) {
+                if (pc->pages[i] == pages[j]) {
+                    refs[j]++;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void vfs_replace_cached_pages(void **old, void **new, int n)
+{
+    struct page_cache *pc;
+
+    list_for_each_entry(pc, &page_caches, list) {
+        for (uint32 i = 0; i < pc->nr_pages; ++i) {
+            if (!pc->pages[i]) {
+                continue;
+            }
+
+            for (int j = 0; j < n; ++j) {
+                if (pc->pages[i] == old[j]) {
+                    pc->pages[i] = new[j];
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void vfs_page_cache_stat_show(void)
+{
+    uart_sync_printf("[page cache] cached pages: %d, hits: %d, "
+                     "shrunk: %d\r\n",
+                     nr_cached_pages, nr_page_cache_hits,
+                     nr_page_cache_shrunk);
+}
+
 static int do_open(const char *pathname, int flags)
 {
     int i, ret;
@@ -483,17 +834,6 @@ static int do_ioctl(int fd, uint64 request, va_list args)
     return ret;
 }
 
-static int do_sync(void)
-{
-    struct filesystem *entry;
-
-    list_for_each_entry(entry, &filesystems, fs_list) {
-        vfs_sync(entry);
-    }
-
-    return 0;
-}
-
 void syscall_open(trapframe *frame, const char *pathname, int flags)
 {
     int fd = do_open(pathname, flags);
@@ -577,9 +917,137 @@ void syscall_ioctl(trapframe *frame, int fd, uint64 request, ...)
 
 void syscall_sync(trapframe *frame)
 {
-    int ret = do_sync();
+    int ret = vfs_sync_all();
 
     frame->x0 = ret;
 
     uart_sync_printf("[sync] = %d\r\n", ret);
-}
\ No newline at end of file
+}
+
+#ifdef STRING_BENCH
+#define BENCH_DEPTH     8
+#define BENCH_SIBLINGS  16
+#define BENCH_ROUNDS    1000
+
+static int byte_strcmp(const char *str1, const char *str2)
+{
+    char c1, c2;
+
+    while ((c1 = *str1++) == (c2 = *str2++) && c1) {};
+
+    return c1 - c2;
+}
+
+static int byte_strcasecmp(const char *s1, const char *s2)
+{
+    char c1, c2;
+
+    while (1) {
+        c1 = *s1++;
+        c2 = *s2++;
+
+        if (!c1 || !c2) {
+            break;
+        }
+
+        if ('A' <= c1 && c1 <= 'Z') {
+            c1 |= 0x20;
+        }
+
+        if ('A' <= c2 && c2 <= 'Z') {
+            c2 |= 0x20;
+        }
+
+        if (c1 != c2) {
+            break;
+        }
+    }
+
+    return c1 - c2;
+}
+
+// Write "directory_<i>" to @p (tmpfs names are under 16 bytes), return
+// the end of it
+static char *bench_name(char *p, int i)
+{
+    p += strcpy(p, "directory_");
+    *p++ = '0' + i / 10;
+    *p++ = '0' + i % 10;
+    *p = '\0';
+
+    return p;
+}
+
+/*
+ * Every directory compared on the way has BENCH_SIBLINGS names with the
+ * same 10-byte prefix, the one walked into is compared last.
+ */
+static uint64 bench_cmp(int (*cmp)(const char *, const char *),
+                        char names[][16])
+{
+    volatile int sink;
+    uint64 start;
+
+    start = read_sysreg(cntpct_el0);
+
+    for (int r = 0; r < BENCH_ROUNDS; ++r) {
+        for (int d = 0; d < BENCH_DEPTH; ++d) {
+            for (int i = 0; i < BENCH_SIBLINGS; ++i) {
+                sink = cmp(names[i], names[BENCH_SIBLINGS - 1]);
+            }
+        }
+    }
+
+    (void)sink;
+
+    return read_sysreg(cntpct_el0) - start;
+}
+
+void vfs_lookup_bench(void)
+{
+    char names[BENCH_SIBLINGS][16];
+    char path[0x100];
+    struct vnode *node;
+    char *end;
+    uint64 start, ticks;
+
+    for (int i = 0; i < BENCH_SIBLINGS; ++i) {
+        bench_name(names[i], i);
+    }
+
+    end = path + strcpy(path, "/bench");
+    vfs_mkdir(path);
+
+    for (int d = 0; d < BENCH_DEPTH; ++d) {
+        *end++ = '/';
+
+        for (int i = 0; i < BENCH_SIBLINGS; ++i) {
+            bench_name(end, i);
+            vfs_mkdir(path);
+        }
+
+        end += strlen(end);
+    }
+
+    start = read_sysreg(cntpct_el0);
+
+    for (int r = 0; r < BENCH_ROUNDS; ++r) {
+        if (vfs_lookup(path, &node) < 0) {
+            uart_sync_printf("[lookup] bench: lookup failed\r\n");
+            return;
+        }
+    }
+
+    ticks = read_sysreg(cntpct_el0) - start;
+
+    uart_sync_printf("[lookup] %d levels x %d lookups: %lld ticks\r\n",
+                     BENCH_DEPTH, BENCH_ROUNDS, ticks);
+    uart_sync_printf("[lookup] name compares: strcmp %lld ticks "
+                     "(byte loop %lld)\r\n",
+                     bench_cmp(strcmp, names), bench_cmp(byte_strcmp, names));
+    uart_sync_printf("[lookup] name compares: strcasecmp %lld ticks "
+                     "(byte loop %lld)\r\n",
+                     bench_cmp(strcasecmp, names),
+                     bench_cmp(byte_strcasecmp, names));
+}
+#endif
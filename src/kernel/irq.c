@@ -7,6 +7,8 @@
 #include <bitops.h>
 #include <sched.h>
 #include <current.h>
+#include <smp.h>
+#include <spinlock.h>
 
 #define IRQ_TASK_NUM 32
 
@@ -44,10 +46,17 @@ struct list_head irq_tasks_meta;
  */
 uint32 irq_tasks_status;
 
-uint32 irq_nested_layer;
+/*
+ * Protects @irq_tasks, @irq_tasks_meta and @irq_tasks_status.
+ * Interrupts are always disabled while holding it, and it is never held
+ * while running an irq_task.
+ */
+static spinlock_t irq_tasks_lock = SPINLOCK_INIT("irq_tasks");
+
+uint32 irq_nested_layer[NR_CPUS];
 
 /*
- * Interrupts must be disabled before calling this function.
+ * Must be called with @irq_tasks_lock held.
  */
 static irq_task *it_alloc()
 {
@@ -64,6 +73,9 @@ static irq_task *it_alloc()
     return &irq_tasks[idx - 1];
 }
 
+/*
+ * Must be called with @irq_tasks_lock held.
+ */
 static void it_release(irq_task *it)
 {
     if (!it) {
@@ -75,6 +87,9 @@ static void it_release(irq_task *it)
     irq_tasks_status |= (1 << idx);
 }
 
+/*
+ * Must be called with @irq_tasks_lock held.
+ */
 static void it_remove(irq_task *it)
 {
     if (!list_empty(&it->np_list)) {
@@ -94,7 +109,7 @@ static void it_remove(irq_task *it)
 }
 
 /*
- * Interrupts must be disabled before calling this function.
+ * Must be called with @irq_tasks_lock held.
  *
  * Return 1 if @it can preempt the currently running irq_task.
  */
@@ -129,6 +144,9 @@ static int it_insert(irq_task *it)
     return preempt;
 }
 
+/*
+ * Must be called with @irq_tasks_lock held.
+ */
 static irq_task *it_get_next_task_to_run()
 {
     irq_task *it;
@@ -152,21 +170,30 @@ static irq_task *it_get_next_task_to_run()
 static inline void it_run()
 {
     while (1) {
-        irq_task *it = it_get_next_task_to_run();
+        irq_task *it;
+
+        spin_lock(&irq_tasks_lock);
+
+        it = it_get_next_task_to_run();
 
         if (!it) {
+            spin_unlock(&irq_tasks_lock);
             break;
         }
 
         it->is_running = 1;
 
+        spin_unlock(&irq_tasks_lock);
+
         enable_interrupt();
 
         (it->cb)(it->args);
 
         disable_interrupt();
 
+        spin_lock(&irq_tasks_lock);
         it_remove(it);
+        spin_unlock(&irq_tasks_lock);
     }
 }
 
@@ -187,9 +214,13 @@ int irq_run_task(void (*task)(void *),
     irq_task *it;
     int preempt;
 
+    spin_lock(&irq_tasks_lock);
+
     it = it_alloc();
 
     if (!it) {
+        spin_unlock(&irq_tasks_lock);
+
         return -1;
     }
 
@@ -203,7 +234,11 @@ int irq_run_task(void (*task)(void *),
 
     if (preempt) {
         it->is_running = 1;
+    }
+
+    spin_unlock(&irq_tasks_lock);
 
+    if (preempt) {
         enable_interrupt();
         
         (task)(args);
@@ -212,7 +247,9 @@ int irq_run_task(void (*task)(void *),
 
         (fini)();
 
+        spin_lock(&irq_tasks_lock);
         it_remove(it);
+        spin_unlock(&irq_tasks_lock);
     }
 
     it_run();
@@ -222,18 +259,25 @@ int irq_run_task(void (*task)(void *),
 
 void irq_handler()
 {
-    irq_nested_layer++;
+    int cpu = smp_processor_id();
+
+    irq_nested_layer[cpu]++;
 
     // These check functions may add irq_task and run it.
-    if (!timer_irq_check()) {}
+    if (cpu) {
+        // Only the core timer interrupt is routed to core 1 ~ 3
+        timer_irq_check();
+    } else if (!timer_irq_check()) {}
     else if (!uart_irq_check()) {}
 
-    irq_nested_layer--;
+    irq_nested_layer[cpu]--;
 
     // IRQ handling completed
 
     // Reschedule
-    if (irq_nested_layer || !current->need_resched || current->preempt) {
+    if (irq_nested_layer[cpu] ||
+        !current->need_resched ||
+        current->preempt) {
         return;
     }
 
@@ -244,6 +288,11 @@ void irq_handler()
     disable_interrupt();
 }
 
+int in_interrupt(void)
+{
+    return irq_nested_layer[smp_processor_id()] != 0;
+}
+
 void exception_default_handler(uint32 n)
 {
     uart_printf("[exception] %d\r\n", n);
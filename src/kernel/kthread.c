@@ -4,6 +4,7 @@
 #include <mm/mm.h>
 #include <waitqueue.h>
 #include <preempt.h>
+#include <smp.h>
 
 static wait_queue_head *wait_queue;
 
@@ -15,6 +16,9 @@ static void kthread_start(void)
                  "mov x19, xzr"
                  : "=r" (main));
 
+    // schedule() switches tasks with interrupts disabled
+    enable_interrupt();
+
     main();
 
     kthread_fini();
@@ -29,7 +33,10 @@ void kthread_add_wait_queue(task_struct *task)
  * Add to wait_queue to wait some process to recycle this kthread
  */
 void kthread_fini(void)
-{    
+{
+    // Released by schedule()
+    lock_kernel();
+
     preempt_disable();
 
     current->status = TASK_DEAD;
@@ -60,7 +67,8 @@ void kthread_init(void)
     // Must set current first
     set_current(task);
 
-    sched_add_task(task);
+    // The booting flow becomes the idle task of core 0
+    sched_set_idle(task, 0);
 
     // Create wait_queue
     wait_queue = wq_create();
@@ -88,7 +96,7 @@ void kthread_create(void (*start)(void))
     
     task = task_create();
 
-    task->kernel_stack = kmalloc(STACK_SIZE);
+    task->kernel_stack = vmalloc(STACK_SIZE);
     task->regs.sp = (char *)task->kernel_stack + STACK_SIZE - 0x10;
     pt_regs_init(&task->regs, start);
 
@@ -104,14 +112,25 @@ void kthread_kill_zombies(void)
             return;
         }
 
+        lock_kernel();
+
         preempt_disable();
         
         task = wq_get_first_task(wait_queue);
 
-        wq_del_task(task);
+        if (__atomic_load_n(&task->on_cpu, __ATOMIC_ACQUIRE)) {
+            // Still running on its stack on another core, try it later
+            preempt_enable();
+            unlock_kernel();
+            return;
+        }
+
+        wq_del_task(task, wait_queue);
 
         preempt_enable();
 
         task_free(task);
+
+        unlock_kernel();
     }
 }
\ No newline at end of file
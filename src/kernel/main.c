@@ -13,6 +13,12 @@
 #include <kthread.h>
 #include <current.h>
 #include <fs/fsinit.h>
+#include <fs/vfs.h>
+#include <mmu.h>
+#include <smp.h>
+#include <signal.h>
+#include <spinlock.h>
+#include <asid.h>
 
 #define BUFSIZE 0x100
 
@@ -85,22 +91,62 @@ static void cmd_free(char *sidx)
     kfree(test_ptrs[idx]);
 }
 
+static void cmd_buddystat(void)
+{
+    page_stat_show();
+}
+
+static void cmd_ptstat(void)
+{
+    pt_stat_show();
+}
+
+static void cmd_vmallocstat(void)
+{
+    vmalloc_stat_show();
+}
+
+static void cmd_zpoolstat(void)
+{
+    zero_pool_stat_show();
+}
+
+static void cmd_pcachestat(void)
+{
+    vfs_page_cache_stat_show();
+}
+
+static void cmd_faultstat(void)
+{
+    task_fault_stat_show();
+}
+
 static void cmd_help(void)
 {
     uart_printf(
                 "alloc <size>\t: "   "test allocator" "\r\n"
+                "buddystat\t: " "print page allocator statistics" "\r\n"
                 "exec <filename>\t: " "execute file"  "\r\n"
+                "faultstat\t: " "print page fault counters of each task" "\r\n"
                 "free <idx>\t: " "test allocator"  "\r\n"
                 "help\t: "   "print this help menu" "\r\n"
                 "hello\t: "  "print Hello World!"   "\r\n"
                 "hwinfo\t: " "print hardware info"  "\r\n"
+#ifdef LOCK_STAT
+                "lockstat\t: " "print spinlock statistics" "\r\n"
+#endif
                 "parsedtb\t: " "parse devicetree blob (dtb)"  "\r\n"
+                "pcachestat\t: " "print page cache statistics" "\r\n"
+                "ptstat\t: " "print page table statistics" "\r\n"
                 "reboot\t: " "reboot the device"    "\r\n"
+                "scstat\t: " "print small chunk allocator statistics" "\r\n"
                 "setTimeout <msg> <sec>\t: " 
                     "print @msg after @sec seconds" "\r\n"
                 "sw_timer\t: " "turn on/off timer debug info" "\r\n"
                 "sw_uart_mode\t: " "use sync/async UART" "\r\n"
                 "thread_test\t: " "test kthread" "\r\n"
+                "vmallocstat\t: " "print vmalloc statistics" "\r\n"
+                "zpoolstat\t: " "print pre-zeroed page pool statistics" "\r\n"
             );
 }
 
@@ -129,6 +175,11 @@ static void cmd_reboot(void)
     BCM2837_reset(10);
 }
 
+static void cmd_scstat(void)
+{
+    sc_stat_show();
+}
+
 static void cmd_setTimeout(char *msg, char *ssec)
 {
     int len;
@@ -181,6 +232,13 @@ static void cmd_thread_test(void)
     }
 }
 
+#ifdef LOCK_STAT
+static void cmd_lockstat(void)
+{
+    lock_stat_show();
+}
+#endif
+
 static int shell_read_cmd(void)
 {
     return uart_recvline(shell_buf, BUFSIZE);
@@ -201,14 +259,24 @@ static void shell(void)
             if (cmd_len >= 6) {
                 cmd_free(&shell_buf[5]);
             }
+        } else if (!strcmp("buddystat", shell_buf)) {
+            cmd_buddystat();
+        } else if (!strcmp("faultstat", shell_buf)) {
+            cmd_faultstat();
         } else if (!strcmp("help", shell_buf)) {
             cmd_help();
         } else if (!strcmp("hello", shell_buf)) {
             cmd_hello();
         } else if (!strcmp("hwinfo", shell_buf)) {
             cmd_hwinfo();
+        } else if (!strcmp("pcachestat", shell_buf)) {
+            cmd_pcachestat();
+        } else if (!strcmp("ptstat", shell_buf)) {
+            cmd_ptstat();
         } else if (!strcmp("reboot", shell_buf)) {
             cmd_reboot();
+        } else if (!strcmp("scstat", shell_buf)) {
+            cmd_scstat();
         } else if (!strncmp("setTimeout", shell_buf, 10)) {
             char *msg, *ssec;
             
@@ -253,10 +321,18 @@ static void shell(void)
             cmd_parsedtb();
         } else if (!strcmp("thread_test", shell_buf)) {
             cmd_thread_test();
+        } else if (!strcmp("vmallocstat", shell_buf)) {
+            cmd_vmallocstat();
+        } else if (!strcmp("zpoolstat", shell_buf)) {
+            cmd_zpoolstat();
         } else if (!strncmp("exec", shell_buf, 4)) {
             if (cmd_len >= 6) {
                 cmd_exec(&shell_buf[5]);
             }
+#ifdef LOCK_STAT
+        } else if (!strcmp("lockstat", shell_buf)) {
+            cmd_lockstat();
+#endif
         } else {
             // Just echo back
             uart_printf("%s\r\n", shell_buf);
@@ -268,6 +344,7 @@ static void idle(void)
 {
     while (1) {
         kthread_kill_zombies();
+        zero_pool_refill();
         schedule();
     }
 }
@@ -280,12 +357,25 @@ void start_kernel(char *fdt)
     uart_init();
     initramfs_init();
     mm_init();
+#ifdef CACHE_BENCH
+    mmu_cache_bench();
+#endif
+#ifdef MEM_BENCH
+    mem_bench();
+#endif
     timer_init();
     task_init();
+    signal_init();
+    vma_init();
+    asid_init();
     scheduler_init();
     kthread_early_init();
     fs_init();
     kthread_init();
+#ifdef STRING_BENCH
+    vfs_lookup_bench();
+#endif
+    smp_init();
 
     uart_printf("[*] fdt base: %x\r\n", fdt_base);
     uart_printf("[*] Kernel start!\r\n");
@@ -10,6 +10,7 @@
 extern char _stack_top;
 
 static uint64 memory_end;
+
 static uint32 memory_node;
 
 // Load 64-bit number (big-endian)
@@ -87,6 +88,7 @@ void mm_init(void)
      */
     page_allocator_init();
     sc_init();
+    vmalloc_init();
 
 #ifdef MM_DEBUG
     page_allocator_test();
@@ -96,11 +98,8 @@ void mm_init(void)
 
 void *kmalloc(int size)
 {
-    uint32 daif;
     void *ret;
 
-    daif = save_and_disable_interrupt();
-
     if (size <= PAGE_SIZE) {
         // Use the Small Chunk allocator
         ret = sc_alloc(size);
@@ -108,31 +107,125 @@ void *kmalloc(int size)
         // Use the Buddy System allocator
         int page_cnt = ALIGN(size, PAGE_SIZE) / PAGE_SIZE;
 
-        ret = alloc_pages(page_cnt);
-    }
+        ret = alloc_pages_exact(page_cnt);
 
-    restore_interrupt(daif);
+        if (!ret && sc_shrink()) {
+            // Retry with the pages reclaimed from the small chunks
+            ret = alloc_pages_exact(page_cnt);
+        }
+    }
 
     return ret;
 }
 
 void kfree(void *ptr)
 {
-    uint32 daif;
-
-    daif = save_and_disable_interrupt();
-
     if (!sc_free(ptr)) {
         /*
          * The chunk pointed to by ptr is managed by the Small Chunk
          * allocator.
          */
-        goto _KFREE_END;
+        return;
     }
 
     free_page(ptr);
+}
+
+#ifdef MEM_BENCH
+#define MEM_BENCH_MAX       (64 * 1024)
+#define MEM_BENCH_BYTES     (1024 * 1024)
+
+#define PMCR_E              (1 << 0)
+#define PMCNTEN_C           (1 << 31)
 
-_KFREE_END:
+typedef void (*mem_bench_f)(char *dst, char *src, uint64 n);
 
-    restore_interrupt(daif);
-}
\ No newline at end of file
+static void bench_byte_copy(char *dst, char *src, uint64 n)
+{
+    volatile char *d = dst;
+
+    while (n--) {
+        *d++ = *src++;
+    }
+}
+
+static void bench_memncpy(char *dst, char *src, uint64 n)
+{
+    memncpy(dst, src, n);
+}
+
+static void bench_memset(char *dst, char *src, uint64 n)
+{
+    memset(dst, 0x5a, n);
+}
+
+static void bench_memmove(char *dst, char *src, uint64 n)
+{
+    // Overlapping, copied backward
+    memmove(dst + 8, dst, n - 8);
+}
+
+/*
+ * Return the bytes per 100 cycles of @f over @n-byte buffers.
+ */
+static uint64 bench_run(mem_bench_f f, char *dst, char *src, uint64 n)
+{
+    uint64 rounds, start, cycles;
+
+    rounds = MEM_BENCH_BYTES / n;
+
+    // Warm up the caches
+    f(dst, src, n);
+
+    start = read_sysreg(pmccntr_el0);
+
+    for (uint64 i = 0; i < rounds; ++i) {
+        f(dst, src, n);
+    }
+
+    cycles = read_sysreg(pmccntr_el0) - start + 1;
+
+    return rounds * n * 100 / cycles;
+}
+
+static void bench_print(const char *name, uint64 bpc)
+{
+    uart_sync_printf(" %s %d.%d%d", name, bpc / 100, bpc / 10 % 10, bpc % 10);
+}
+
+void mem_bench(void)
+{
+    char *src, *dst;
+
+    src = kmalloc(MEM_BENCH_MAX);
+    dst = kmalloc(MEM_BENCH_MAX);
+
+    if (!src || !dst) {
+        uart_sync_printf("[mem] bench: out of memory\r\n");
+        return;
+    }
+
+    memset(src, 0xa5, MEM_BENCH_MAX);
+
+    // Enable the cycle counter
+    write_sysreg(pmcr_el0, read_sysreg(pmcr_el0) | PMCR_E);
+    write_sysreg(pmcntenset_el0, PMCNTEN_C);
+
+    uart_sync_printf("[mem] bytes per cycle\r\n");
+
+    for (uint64 n = 16; n <= MEM_BENCH_MAX; n *= 4) {
+        uart_sync_printf("[mem] %d:", n);
+        bench_print("byte loop", bench_run(bench_byte_copy, dst, src, n));
+        bench_print("memncpy", bench_run(bench_memncpy, dst, src, n));
+        // Source misaligned to the destination
+        bench_print("memncpy+3", bench_run(bench_memncpy, dst, src + 3,
+                                           n - 3));
+        bench_print("memset", bench_run(bench_memset, dst, src, n));
+        bench_print("memmove", bench_run(bench_memmove, dst, src, n));
+        uart_sync_printf("\r\n");
+    }
+
+    kfree(src);
+    kfree(dst);
+}
+#endif
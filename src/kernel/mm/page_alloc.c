@@ -2,19 +2,40 @@
  * Implementation of Buddy System.
  */
 
-// TODO: Consider critical section
-
 #include <mm/early_alloc.h>
 #include <mm/page_alloc.h>
 #include <list.h>
 #include <utils.h>
 #include <bitops.h>
 #include <mini_uart.h>
+#include <spinlock.h>
+#include <preempt.h>
+#include <current.h>
+#include <irq.h>
+#include <smp.h>
+#include <task.h>
 
 #define FREELIST_CNT 16
 
+/*
+ * Free memory is grouped by pageblocks of 2^PAGEBLOCK_ORDER pages: the
+ * kernel allocates from the MIGRATE_UNMOVABLE pageblocks, user pages come
+ * from the MIGRATE_MOVABLE ones (see alloc_page_movable()), so a few
+ * kernel pages don't pin every large block. When a type runs out of free
+ * blocks, it takes the largest one of the other type.
+ */
+#define MIGRATE_UNMOVABLE 0
+#define MIGRATE_MOVABLE   1
+#define MIGRATE_TYPES     2
+
+#define PAGEBLOCK_ORDER   6
+
 typedef struct {
-    uint8 exp:7;
+    uint8 exp:5;
+    /* A user page, allocated by alloc_page_movable() */
+    uint8 movable:1;
+    /* Not the last block of an alloc_pages_exact() allocation */
+    uint8 more:1;
     uint8 allocated:1;
 } frame_ent;
 
@@ -26,10 +47,106 @@ typedef struct {
 uint64 buddy_base;
 uint64 buddy_end;
 
+/*
+ * @exp and @allocated are only meaningful for the first frame of an
+ * allocated (or reserved) block. Free blocks are tracked by
+ * @free_bitmaps.
+ */
 frame_ent *frame_ents;
 uint32 frame_ents_size;
 
-struct list_head freelists[FREELIST_CNT];
+struct list_head freelists[MIGRATE_TYPES][FREELIST_CNT];
+
+/* Migrate type of each pageblock */
+static uint8 *pageblock_types;
+
+/*
+ * Bit (idx >> exp) of free_bitmaps[exp] is set if the block of 2^exp pages
+ * starting at frame idx is in freelists[type][exp].
+ */
+static uint64 *free_bitmaps[FREELIST_CNT];
+
+/* Bit exp of free_area_mask[type] is set if freelists[type][exp] isn't empty */
+static uint32 free_area_mask[MIGRATE_TYPES];
+
+/* Number of blocks in freelists[type][exp] */
+static uint32 nr_free[MIGRATE_TYPES][FREELIST_CNT];
+
+/*
+ * Pages lost to the power-of-two rounding of alloc_pages(), and the pages
+ * alloc_pages_exact() gave back instead, since boot.
+ */
+static uint64 nr_rounding_waste;
+static uint64 nr_exact_returned;
+
+/*
+ * Allocations served by the other migrate type, and the pageblocks changed
+ * to the allocating type by them.
+ */
+static uint64 nr_fallbacks;
+static uint64 nr_pageblocks_stolen;
+
+/* Compaction runs, see compact_pages(), and the user pages moved by them */
+static uint64 nr_compact_success;
+static uint64 nr_compact_fail;
+static uint64 nr_pages_migrated;
+
+/*
+ * The frame compact_pages() goes on from, instead of scanning the ranges
+ * already found wanting again. Only used with the kernel lock held.
+ */
+static int compact_cursor;
+
+/*
+ * Number of users of each frame, see page_ref_init(). Only the pages
+ * mapped into user space are counted, all of them are updated with the
+ * kernel lock held.
+ */
+static uint16 *page_refs;
+
+/*
+ * Protects @freelists, @frame_ents, @free_bitmaps, @free_area_mask and
+ * @pageblock_types
+ */
+static spinlock_t buddy_lock = SPINLOCK_INIT("buddy");
+
+/*
+ * Each CPU caches order-0 pages in @lists, one per migrate type: hot pages
+ * (just freed, likely still in the cache) are at the head, cold pages at
+ * the tail. An empty list is refilled with PCP_BATCH pages, and when
+ * @count exceeds PCP_HIGH the PCP_BATCH coldest pages go back to the Buddy
+ * System.
+ *
+ * Pages in @lists are allocated from the point of view of the Buddy System.
+ */
+#define PCP_HIGH  64
+#define PCP_BATCH 16
+
+struct per_cpu_pages {
+    struct list_head lists[MIGRATE_TYPES];
+    /* Pages in all @lists */
+    uint32 count;
+    /* Served from @lists */
+    uint64 alloc_hit;
+    uint64 free_hit;
+    /* Number of refills / drains */
+    uint64 refill;
+    uint64 drain;
+} __attribute__((aligned(64)));
+
+static struct per_cpu_pages pcp_lists[NR_CPUS];
+
+#ifdef MM_DEBUG
+/* Set while measuring latency, see page_allocator_test() */
+static int buddy_quiet;
+
+#define buddy_debug(...) do {             \
+    if (!buddy_quiet)                     \
+        uart_sync_printf(__VA_ARGS__);    \
+} while (0)
+#else
+#define buddy_debug(...) do { } while (0)
+#endif
 
 /*
  * Convert number of pages to the corresponding idx (or say exp) of freelists
@@ -57,6 +174,76 @@ static inline int is_valid_page(void *page)
     return 1;
 }
 
+static inline int pageblock_type(int idx)
+{
+    return pageblock_types[idx >> PAGEBLOCK_ORDER];
+}
+
+/*
+ * Set the type of the pageblocks covered by the block of 2^@exp pages
+ * starting at frame @idx.
+ * Must be called with @buddy_lock held.
+ */
+static void set_pageblock_type(int idx, int exp, int type)
+{
+    int end = idx + (1 << exp);
+
+    for (; idx < end; idx += 1 << PAGEBLOCK_ORDER) {
+        pageblock_types[idx >> PAGEBLOCK_ORDER] = type;
+    }
+}
+
+/*
+ * The block goes to the freelist of its pageblock type. A block larger
+ * than a pageblock takes the type of its first pageblock, so a free block
+ * never mixes the types.
+ * Must be called with @buddy_lock held.
+ */
+static inline void free_area_add(int idx, int exp)
+{
+    frame_hdr *hdr;
+    int type;
+
+    type = pageblock_type(idx);
+
+    if (exp > PAGEBLOCK_ORDER) {
+        set_pageblock_type(idx, exp, type);
+    }
+
+    hdr = idx2addr(idx);
+    list_add(&hdr->list, &freelists[type][exp]);
+
+    set_bit(free_bitmaps[exp], idx >> exp);
+    free_area_mask[type] |= 1 << exp;
+    nr_free[type][exp] += 1;
+}
+
+/*
+ * Must be called with @buddy_lock held.
+ */
+static inline void free_area_del(int idx, int exp)
+{
+    frame_hdr *hdr;
+    int type;
+
+    type = pageblock_type(idx);
+
+    hdr = idx2addr(idx);
+    list_del(&hdr->list);
+
+    clear_bit(free_bitmaps[exp], idx >> exp);
+    nr_free[type][exp] -= 1;
+
+    if (!nr_free[type][exp]) {
+        free_area_mask[type] &= ~(1 << exp);
+    }
+}
+
+static inline int is_free_block(int idx, int exp)
+{
+    return test_bit(free_bitmaps[exp], idx >> exp);
+}
+
 void page_allocator_early_init(void *start, void *end)
 {
     buddy_base = (uint64)start;
@@ -66,9 +253,32 @@ void page_allocator_early_init(void *start, void *end)
 
     frame_ents = early_malloc(sizeof(frame_ent) * frame_ents_size);
 
+    page_refs = early_malloc(sizeof(uint16) * frame_ents_size);
+
+    pageblock_types = early_malloc((frame_ents_size >> PAGEBLOCK_ORDER) + 1);
+
+    // The kernel takes what it needs, see __alloc_pages()
+    for (int i = 0; i <= frame_ents_size >> PAGEBLOCK_ORDER; ++i) {
+        pageblock_types[i] = MIGRATE_MOVABLE;
+    }
+
     for (int i = 0; i < frame_ents_size; ++i) {
         frame_ents[i].exp = 0;
+        frame_ents[i].movable = 0;
+        frame_ents[i].more = 0;
         frame_ents[i].allocated = 0;
+        page_refs[i] = 0;
+    }
+
+    for (int exp = 0; exp < FREELIST_CNT; ++exp) {
+        uint32 nbits = (frame_ents_size >> exp) + 1;
+        uint32 nwords = ALIGN(nbits, 64) / 64;
+
+        free_bitmaps[exp] = early_malloc(sizeof(uint64) * nwords);
+
+        for (int i = 0; i < nwords; ++i) {
+            free_bitmaps[exp][i] = 0;
+        }
     }
 
 #ifdef MM_DEBUG
@@ -94,127 +304,202 @@ void mem_reserve(void *start, void *end)
 
 void page_allocator_init(void)
 {
-    for (int i = 0; i < FREELIST_CNT; ++i) {
-        INIT_LIST_HEAD(&freelists[i]);
+#ifdef MM_DEBUG
+    uint64 t_begin = read_sysreg(cntpct_el0);
+#endif
+    int next_rsv;
+
+    for (int type = 0; type < MIGRATE_TYPES; ++type) {
+        for (int i = 0; i < FREELIST_CNT; ++i) {
+            INIT_LIST_HEAD(&freelists[type][i]);
+            nr_free[type][i] = 0;
+        }
+
+        free_area_mask[type] = 0;
     }
 
-    // Merge buddys from bottom to top
-    for (int exp = 0, idx; exp + 1 < FREELIST_CNT; exp++) {
-        idx = 0;
+    for (int cpu = 0; cpu < NR_CPUS; ++cpu) {
+        for (int type = 0; type < MIGRATE_TYPES; ++type) {
+            INIT_LIST_HEAD(&pcp_lists[cpu].lists[type]);
+        }
 
-        while (1) {
-            int buddy_idx;
-            
-            buddy_idx = idx ^ (1 << exp);
+        pcp_lists[cpu].count = 0;
+    }
 
-            if (buddy_idx >= frame_ents_size) {
-                break;
-            }
+    /*
+     * Single pass: at each free frame, take the largest naturally aligned
+     * block which ends before the next reserved frame.
+     */
+    next_rsv = 0;
 
-            if (!frame_ents[idx].allocated &&
-                frame_ents[idx].exp == exp &&
-                !frame_ents[buddy_idx].allocated &&
-                frame_ents[buddy_idx].exp == exp) {
-                frame_ents[idx].exp = exp + 1;
-            }
+    for (int idx = 0, exp; idx < frame_ents_size; idx += (1 << exp)) {
+        if (frame_ents[idx].allocated) {
+            exp = 0;
+            continue;
+        }
 
-            idx += (1 << (exp + 1));
+        if (next_rsv <= idx) {
+            next_rsv = idx + 1;
 
-            if (idx >= frame_ents_size) {
-                break;
+            while (next_rsv < frame_ents_size &&
+                   !frame_ents[next_rsv].allocated) {
+                next_rsv++;
             }
         }
-    }
 
-    // Update freelists
-    for (int idx = 0, exp; idx < frame_ents_size; idx += (1 << exp)) {
-        exp = frame_ents[idx].exp;
+        exp = FREELIST_CNT - 1;
+
+        while (idx & ((1 << exp) - 1) || idx + (1 << exp) > next_rsv) {
+            exp--;
+        }
 
-        if (!frame_ents[idx].allocated) {
-            frame_hdr *hdr;
+        free_area_add(idx, exp);
 
-            hdr = idx2addr(idx);
-            list_add_tail(&hdr->list, &freelists[exp]);
+        frame_ents[idx].exp = exp;
 
 #ifdef MM_DEBUG
-            uart_sync_printf("[*] page init, idx %d belong to exp %d\r\n",
-                        idx, exp);
+        uart_sync_printf("[*] page init, idx %d belong to exp %d\r\n",
+                    idx, exp);
 #endif
-        }
     }
+
+#ifdef MM_DEBUG
+    uart_sync_printf("[*] page_allocator_init: %lld ticks (cntfrq: %lld)\r\n",
+                read_sysreg(cntpct_el0) - t_begin, read_sysreg(cntfrq_el0));
+#endif
 }
 
-void *alloc_pages(int num)
+/*
+ * Allocate a block of 2^@exp pages of migrate type @type.
+ * Must be called with @buddy_lock held.
+ */
+static void *__alloc_pages(int exp, int type)
 {
-    frame_hdr *hdr;
-    int idx, topexp, exp;
+    uint32 mask;
+    int idx, topexp;
 
-#ifdef MM_DEBUG
-    uart_sync_printf("[*] alloc_pages %d pages\r\n", num);
-#endif
+    // The smallest non-empty freelist which is large enough
+    mask = free_area_mask[type] & ~((1 << exp) - 1);
 
-    if (!num) {
-        return NULL;
-    }
+    if (mask) {
+        topexp = ffs(mask) - 1;
 
-    exp = num2exp(num);
+        idx = addr2idx(list_first_entry(&freelists[type][topexp],
+                                        frame_hdr, list));
 
-    if (exp >= FREELIST_CNT) {
-        return NULL;
-    }
+        free_area_del(idx, topexp);
+    } else {
+        int other = MIGRATE_TYPES - 1 - type;
 
-    for (topexp = exp; topexp < FREELIST_CNT; topexp++) {
-        if (!list_empty(&freelists[topexp])) {
-            break;
+        // Take the largest block of the other type, the rest of it likely
+        // serves the next allocations of @type too
+        mask = free_area_mask[other] & ~((1 << exp) - 1);
+
+        if (!mask) {
+            return NULL;
         }
-    }
 
-    if (topexp == FREELIST_CNT) {
-        return NULL;
-    }
+        topexp = fls(mask) - 1;
 
-    // Allocate
-    hdr = list_first_entry(&freelists[topexp], frame_hdr, list);
-    idx = addr2idx(hdr);
+        idx = addr2idx(list_first_entry(&freelists[other][topexp],
+                                        frame_hdr, list));
 
-    list_del(&hdr->list);
+        free_area_del(idx, topexp);
+
+        // The whole pageblocks change hands, the buddies split off below
+        // go to the freelists of @type
+        if (topexp >= PAGEBLOCK_ORDER) {
+            set_pageblock_type(idx, topexp, type);
+            nr_pageblocks_stolen += 1 << (topexp - PAGEBLOCK_ORDER);
+        }
+
+        nr_fallbacks++;
+    }
 
     // Expand
     while (topexp != exp) {
-        frame_hdr *buddy_hdr;
         int buddy_idx;
 
         topexp -= 1;
         buddy_idx = idx ^ (1 << topexp);
 
-        frame_ents[buddy_idx].exp = topexp;
-        frame_ents[buddy_idx].allocated = 0;
-
-        buddy_hdr = idx2addr(buddy_idx);
-        list_add(&buddy_hdr->list, &freelists[topexp]);
+        free_area_add(buddy_idx, topexp);
 
-#ifdef MM_DEBUG
-        uart_sync_printf("[*] Expand to idx (%d, %d) to exp (%d)\r\n",
+        buddy_debug("[*] Expand to idx (%d, %d) to exp (%d)\r\n",
             idx, buddy_idx, topexp);
-#endif
     }
 
     frame_ents[idx].exp = exp;
     frame_ents[idx].allocated = 1;
 
-#ifdef MM_DEBUG
-    uart_sync_printf("[*] Allocate idx %d exp %d\r\n", 
+    buddy_debug("[*] Allocate idx %d exp %d\r\n", 
         idx, exp);
-#endif
 
-    return (void *)hdr;
+    return idx2addr(idx);
 }
 
-void *alloc_page(void)
+/*
+ * Split the allocated block of 2^num2exp(@num) pages at @page into the
+ * allocated blocks covering @num pages, chained by @more, and the blocks
+ * of the tail, which go back to the freelists.
+ * Must be called with @buddy_lock held.
+ */
+static void *trim_pages_exact(void *page, int num)
 {
-    return alloc_pages(1);
+    int idx, end, exp, i;
+
+    exp = num2exp(num);
+    idx = addr2idx(page);
+    end = idx + (1 << exp);
+
+    // Largest first, so each block is aligned to its size
+    for (i = idx; i < idx + num; i += 1 << exp) {
+        exp = fls(idx + num - i) - 1;
+
+        frame_ents[i].exp = exp;
+        frame_ents[i].allocated = 1;
+        frame_ents[i].more = i + (1 << exp) < idx + num;
+    }
+
+    // The buddies of the tail blocks are allocated, nothing to merge
+    for (; i < end; i += 1 << exp) {
+        exp = ffs(i) - 1;
+
+        while (i + (1 << exp) > end) {
+            exp--;
+        }
+
+        frame_ents[i].exp = exp;
+
+        free_area_add(i, exp);
+    }
+
+    nr_exact_returned += end - idx - num;
+
+    buddy_debug("[*] Allocate idx %d %d pages exactly\r\n", idx, num);
+
+    return page;
 }
 
+/*
+ * Must be called with @buddy_lock held.
+ */
+static void *__alloc_pages_exact(int num)
+{
+    void *page;
+
+    page = __alloc_pages(num2exp(num), MIGRATE_UNMOVABLE);
+
+    if (!page) {
+        return NULL;
+    }
+
+    return trim_pages_exact(page, num);
+}
+
+/*
+ * Must be called with @buddy_lock held.
+ */
 static inline void _free_page(frame_hdr *page)
 {
     int idx, buddy_idx, exp;
@@ -223,53 +508,665 @@ static inline void _free_page(frame_hdr *page)
     exp = frame_ents[idx].exp;
 
     frame_ents[idx].allocated = 0;
-    list_add(&page->list, &freelists[exp]);
+    frame_ents[idx].movable = 0;
+    frame_ents[idx].more = 0;
 
     buddy_idx = idx ^ (1 << exp);
 
     // Merge buddy
     while (exp + 1 < FREELIST_CNT &&
-           !frame_ents[buddy_idx].allocated &&
-           frame_ents[buddy_idx].exp == exp) {
-#ifdef MM_DEBUG
-        uart_sync_printf("[*] merge idx (%d, %d) to exp (%d)\r\n",
+           buddy_idx < frame_ents_size &&
+           is_free_block(buddy_idx, exp)) {
+        buddy_debug("[*] merge idx (%d, %d) to exp (%d)\r\n",
                     idx, buddy_idx, exp + 1);
-#endif
 
-        frame_hdr *hdr;
+        free_area_del(buddy_idx, exp);
 
         exp += 1;
+        idx = idx & buddy_idx;
+        buddy_idx = idx ^ (1 << exp);
+    }
 
-        hdr = idx2addr(idx);
-        list_del(&hdr->list);
+    frame_ents[idx].exp = exp;
+
+    free_area_add(idx, exp);
+}
+
+/*
+ * The per-CPU lists are only used in task context, see can_use_magazine()
+ * in sc_alloc.c.
+ */
+static inline int can_use_pcp(void)
+{
+    return current && !in_interrupt();
+}
+
+static void pcp_refill(struct per_cpu_pages *pcp, int type)
+{
+    uint32 daif;
+
+    daif = spin_lock_irqsave(&buddy_lock);
+
+    for (int i = 0; i < PCP_BATCH; ++i) {
+        frame_hdr *hdr = __alloc_pages(0, type);
+
+        if (!hdr) {
+            break;
+        }
+
+        // A stolen page goes back to the list of its pageblock when freed
+        list_add_tail(&hdr->list, &pcp->lists[type]);
+        pcp->count += 1;
+    }
+
+    spin_unlock_irqrestore(&buddy_lock, daif);
+
+    pcp->refill += 1;
+}
+
+/*
+ * Return the @cnt coldest pages to the Buddy System, the movable ones
+ * first.
+ */
+static void pcp_drain(struct per_cpu_pages *pcp, uint32 cnt)
+{
+    uint32 daif;
+
+    daif = spin_lock_irqsave(&buddy_lock);
+
+    for (int type = MIGRATE_TYPES - 1; type >= 0; --type) {
+        struct list_head *list = &pcp->lists[type];
+
+        while (cnt && !list_empty(list)) {
+            frame_hdr *hdr = list_last_entry(list, frame_hdr, list);
+
+            list_del(&hdr->list);
+            pcp->count -= 1;
+            cnt -= 1;
+
+            _free_page(hdr);
+        }
+    }
+
+    spin_unlock_irqrestore(&buddy_lock, daif);
+
+    pcp->drain += 1;
+}
+
+static void *pcp_alloc(int type)
+{
+    struct per_cpu_pages *pcp;
+    frame_hdr *hdr;
+
+    preempt_disable();
+
+    pcp = &pcp_lists[smp_processor_id()];
+
+    if (list_empty(&pcp->lists[type])) {
+        pcp_refill(pcp, type);
+    } else {
+        pcp->alloc_hit += 1;
+    }
+
+    hdr = NULL;
+
+    if (!list_empty(&pcp->lists[type])) {
+        hdr = list_first_entry(&pcp->lists[type], frame_hdr, list);
 
-        hdr = idx2addr(buddy_idx);
         list_del(&hdr->list);
+        pcp->count -= 1;
+    }
 
-        idx = idx & buddy_idx;
-        hdr = idx2addr(idx);
+    preempt_enable();
 
-        frame_ents[idx].exp = exp;
-        list_add(&hdr->list, &freelists[exp]);
+    return hdr;
+}
 
-        buddy_idx = idx ^ (1 << exp);
+static void pcp_free(frame_hdr *page, int cold)
+{
+    struct per_cpu_pages *pcp;
+    struct list_head *list;
+
+    preempt_disable();
+
+    pcp = &pcp_lists[smp_processor_id()];
+
+    /*
+     * @pageblock_types is read without @buddy_lock: the pageblock of an
+     * allocated page can't change its type, a stale type just puts the
+     * page on the other list.
+     */
+    list = &pcp->lists[pageblock_type(addr2idx(page))];
+
+    if (cold) {
+        list_add_tail(&page->list, list);
+    } else {
+        list_add(&page->list, list);
     }
+
+    pcp->count += 1;
+    pcp->free_hit += 1;
+
+    if (pcp->count > PCP_HIGH) {
+        pcp_drain(pcp, PCP_BATCH);
+    }
+
+    preempt_enable();
 }
 
-void free_page(void *page)
+void drain_local_pages(void)
+{
+    struct per_cpu_pages *pcp;
+
+    if (!can_use_pcp()) {
+        return;
+    }
+
+    preempt_disable();
+
+    pcp = &pcp_lists[smp_processor_id()];
+    pcp_drain(pcp, pcp->count);
+
+    preempt_enable();
+}
+
+/*
+ * Shrinking the page cache and compaction change @page_refs and the page
+ * tables, which only stay still under the kernel lock. Both are only tried
+ * for the blocks larger than a page and for alloc_page_movable(): the
+ * single kernel pages are also allocated with the locks of the small
+ * chunks or vmalloc held, and no kernel path holds a user page across a
+ * larger allocation.
+ */
+static inline int can_reclaim(void)
 {
+    task_struct *task = current;
+
+    return task && task->lock_depth && !in_interrupt();
+}
+
+/*
+ * Return the exp of the free block starting at frame @idx, -1 if there is
+ * none not larger than 2^@maxexp.
+ * Must be called with @buddy_lock held.
+ */
+static int free_block_exp(int idx, int maxexp)
+{
+    for (int exp = 0; exp <= maxexp && !(idx & ((1 << exp) - 1)); ++exp) {
+        if (is_free_block(idx, exp)) {
+            return exp;
+        }
+    }
+
+    return -1;
+}
+
+static inline int is_migratable(int idx)
+{
+    return frame_ents[idx].allocated && frame_ents[idx].movable &&
+           !frame_ents[idx].exp && !frame_ents[idx].more && page_refs[idx];
+}
+
+/*
+ * Take the 2^@exp frames from @start if all of them are in movable
+ * pageblocks, and each one is free or a mapped user page: the free blocks
+ * leave the freelists, marked allocated and not movable, as are the user
+ * pages once moved away.
+ * Return 0 if the range isn't taken.
+ * Must be called with @buddy_lock held.
+ */
+static int compact_isolate(int start, int exp)
+{
+    int idx, end, e;
+
+    end = start + (1 << exp);
+
+    for (idx = start; idx < end; idx += 1 << PAGEBLOCK_ORDER) {
+        if (pageblock_type(idx) != MIGRATE_MOVABLE) {
+            return 0;
+        }
+    }
+
+    for (idx = start; idx < end; idx += 1 << e) {
+        e = free_block_exp(idx, exp);
+
+        if (e < 0) {
+            if (!is_migratable(idx)) {
+                return 0;
+            }
+
+            e = 0;
+        }
+    }
+
+    for (idx = start; idx < end; idx += 1 << e) {
+        e = free_block_exp(idx, exp);
+
+        if (e < 0) {
+            e = 0;
+            continue;
+        }
+
+        free_area_del(idx, e);
+
+        frame_ents[idx].exp = e;
+        frame_ents[idx].allocated = 1;
+    }
+
+    return 1;
+}
+
+/*
+ * Give back the frames taken by compact_isolate(), the user pages not
+ * moved yet stay where they are.
+ * Must be called with @buddy_lock held.
+ */
+static void compact_putback(int start, int exp)
+{
+    int idx, end, e;
+
+    end = start + (1 << exp);
+
+    for (idx = start; idx < end; idx += 1 << e) {
+        e = frame_ents[idx].exp;
+
+        if (!frame_ents[idx].movable) {
+            _free_page(idx2addr(idx));
+        }
+    }
+}
+
+/*
+ * Move the user pages in @start ~ @start + 2^@exp to pages allocated
+ * elsewhere, see migrate_user_pages().
+ * Return 0 if all of them are moved.
+ */
+static int compact_migrate(int start, int exp)
+{
+    void *old[MIGRATE_BATCH], *new[MIGRATE_BATCH];
+    int idx, end, n, ret;
+
+    end = start + (1 << exp);
+    ret = 0;
+
+    for (idx = start; idx < end;) {
+        // The frames of the range only change here, no lock needed
+        for (n = 0; idx < end && n < MIGRATE_BATCH; ++idx) {
+            if (!frame_ents[idx].movable) {
+                continue;
+            }
+
+            new[n] = alloc_page_movable();
+
+            if (!new[n]) {
+                ret = -1;
+                break;
+            }
+
+            old[n++] = idx2addr(idx);
+        }
+
+        if (!ret && n) {
+            ret = migrate_user_pages(old, new, n);
+        }
+
+        if (ret) {
+            while (n--) {
+                free_page(new[n]);
+            }
+
+            return -1;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int from = addr2idx(old[i]);
+
+            page_refs[addr2idx(new[i])] = page_refs[from];
+            page_refs[from] = 0;
+
+            frame_ents[from].movable = 0;
+        }
+
+        nr_pages_migrated += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Make a free block of 2^@exp pages by moving the user pages out of a
+ * movable range, the first range from @compact_cursor whose frames are all
+ * free or user pages is taken. Return the block allocated, or NULL if no
+ * range qualifies or the pages can't be moved.
+ * Must be called with the kernel lock held, see can_reclaim().
+ */
+static void *compact_pages(int exp)
+{
+    uint32 daif;
+    int start, ret, n;
+
+    start = compact_cursor & ~((1 << exp) - 1);
+
+    for (n = frame_ents_size >> exp; n > 0; --n, start += 1 << exp) {
+        if (start + (1 << exp) > frame_ents_size) {
+            start = 0;
+        }
+
+        daif = spin_lock_irqsave(&buddy_lock);
+
+        ret = compact_isolate(start, exp);
+
+        spin_unlock_irqrestore(&buddy_lock, daif);
+
+        if (!ret) {
+            continue;
+        }
+
+        ret = compact_migrate(start, exp);
+
+        daif = spin_lock_irqsave(&buddy_lock);
+
+        if (ret) {
+            compact_putback(start, exp);
+            nr_compact_fail++;
+        } else {
+            frame_ents[start].exp = exp;
+            frame_ents[start].allocated = 1;
+            frame_ents[start].more = 0;
+            nr_compact_success++;
+        }
+
+        spin_unlock_irqrestore(&buddy_lock, daif);
+
+        buddy_debug("[*] Compact idx %d exp %d: %d\r\n", start, exp, ret);
+
+        compact_cursor = start + (1 << exp);
+
+        // Out of pages, or some page is mapped beyond the page tables
+        return ret ? NULL : idx2addr(start);
+    }
+
+    nr_compact_fail++;
+
+    return NULL;
+}
+
+void *alloc_pages(int num)
+{
+    void *page;
+    uint32 daif;
+    int exp;
+
+    buddy_debug("[*] alloc_pages %d pages\r\n", num);
+
+    if (!num) {
+        return NULL;
+    }
+
+    exp = num2exp(num);
+
+    if (exp >= FREELIST_CNT) {
+        return NULL;
+    }
+
+    if (!exp && can_use_pcp()) {
+        return pcp_alloc(MIGRATE_UNMOVABLE);
+    }
+
+    daif = spin_lock_irqsave(&buddy_lock);
+
+    page = __alloc_pages(exp, MIGRATE_UNMOVABLE);
+
+    spin_unlock_irqrestore(&buddy_lock, daif);
+
+    if (!page && exp && can_use_pcp()) {
+        // The pages cached by this CPU may be merged into a larger block
+        drain_local_pages();
+
+        daif = spin_lock_irqsave(&buddy_lock);
+
+        page = __alloc_pages(exp, MIGRATE_UNMOVABLE);
+
+        spin_unlock_irqrestore(&buddy_lock, daif);
+    }
+
+    // Try again once the unmapped file pages are freed
+    if (!page && exp && can_reclaim() && vfs_shrink_page_cache()) {
+        return alloc_pages(num);
+    }
+
+    if (!page && exp && can_reclaim()) {
+        page = compact_pages(exp);
+    }
+
+    if (page) {
+        __atomic_fetch_add(&nr_rounding_waste, (1 << exp) - num,
+                           __ATOMIC_RELAXED);
+    }
+
+    return page;
+}
+
+void *alloc_pages_exact(int num)
+{
+    void *page;
+    uint32 daif;
+
+    buddy_debug("[*] alloc_pages_exact %d pages\r\n", num);
+
+    if (!num || num2exp(num) >= FREELIST_CNT) {
+        return NULL;
+    }
+
+    if (num == 1) {
+        return alloc_pages(1);
+    }
+
+    daif = spin_lock_irqsave(&buddy_lock);
+
+    page = __alloc_pages_exact(num);
+
+    spin_unlock_irqrestore(&buddy_lock, daif);
+
+    if (!page && can_use_pcp()) {
+        // The pages cached by this CPU may be merged into a larger block
+        drain_local_pages();
+
+        daif = spin_lock_irqsave(&buddy_lock);
+
+        page = __alloc_pages_exact(num);
+
+        spin_unlock_irqrestore(&buddy_lock, daif);
+    }
+
+    if (!page && can_reclaim() && vfs_shrink_page_cache()) {
+        return alloc_pages_exact(num);
+    }
+
+    if (!page && can_reclaim()) {
+        page = compact_pages(num2exp(num));
+
+        if (page) {
+            daif = spin_lock_irqsave(&buddy_lock);
+
+            trim_pages_exact(page, num);
+
+            spin_unlock_irqrestore(&buddy_lock, daif);
+        }
+    }
+
+    return page;
+}
+
+void free_pages_exact(void *page)
+{
+    uint32 daif;
+    int idx, more;
+
     if (!is_valid_page(page)) {
         return;
     }
 
-#ifdef MM_DEBUG
-    uart_sync_printf("[*] free_page idx %d\r\n", addr2idx(page));
-#endif
+    idx = addr2idx(page);
+
+    daif = spin_lock_irqsave(&buddy_lock);
+
+    do {
+        int next = idx + (1 << frame_ents[idx].exp);
+
+        more = frame_ents[idx].more;
+
+        _free_page(idx2addr(idx));
+
+        idx = next;
+    } while (more);
+
+    spin_unlock_irqrestore(&buddy_lock, daif);
+}
+
+void *alloc_page(void)
+{
+    return alloc_pages(1);
+}
+
+void *alloc_page_movable(void)
+{
+    void *page;
+    uint32 daif;
+
+    if (can_use_pcp()) {
+        page = pcp_alloc(MIGRATE_MOVABLE);
+    } else {
+        daif = spin_lock_irqsave(&buddy_lock);
+
+        page = __alloc_pages(0, MIGRATE_MOVABLE);
+
+        spin_unlock_irqrestore(&buddy_lock, daif);
+    }
+
+    if (!page && can_reclaim() && vfs_shrink_page_cache()) {
+        return alloc_page_movable();
+    }
+
+    if (page) {
+        frame_ents[addr2idx(page)].movable = 1;
+    }
+
+    return page;
+}
+
+static void free_hot_cold_page(void *page, int cold)
+{
+    uint32 daif;
+
+    if (!is_valid_page(page)) {
+        return;
+    }
+
+    buddy_debug("[*] free_page idx %d\r\n", addr2idx(page));
+
+    frame_ents[addr2idx(page)].movable = 0;
+
+    if (frame_ents[addr2idx(page)].more) {
+        free_pages_exact(page);
+        return;
+    }
+
+    if (!frame_ents[addr2idx(page)].exp && can_use_pcp()) {
+        pcp_free((frame_hdr *)page, cold);
+        return;
+    }
+
+    daif = spin_lock_irqsave(&buddy_lock);
 
     _free_page((frame_hdr *)page);
+
+    spin_unlock_irqrestore(&buddy_lock, daif);
+}
+
+void free_page(void *page)
+{
+    free_hot_cold_page(page, 0);
+}
+
+void free_page_cold(void *page)
+{
+    free_hot_cold_page(page, 1);
+}
+
+void page_ref_init(void *page)
+{
+    page_refs[addr2idx(page)] = 1;
+}
+
+void page_ref_inc(void *page)
+{
+    page_refs[addr2idx(page)]++;
+}
+
+uint32 page_ref_dec(void *page)
+{
+    return --page_refs[addr2idx(page)];
+}
+
+uint32 page_ref_count(void *page)
+{
+    return page_refs[addr2idx(page)];
+}
+
+void page_stat_show(void)
+{
+    uint32 nr_pageblocks[MIGRATE_TYPES] = { 0 };
+    uint32 daif;
+
+    daif = spin_lock_irqsave(&buddy_lock);
+
+    for (int exp = 0; exp < FREELIST_CNT; ++exp) {
+        uart_sync_printf("[buddy] order %d: %d free (unmovable %d, "
+                         "movable %d)\r\n", exp,
+                         nr_free[MIGRATE_UNMOVABLE][exp] +
+                         nr_free[MIGRATE_MOVABLE][exp],
+                         nr_free[MIGRATE_UNMOVABLE][exp],
+                         nr_free[MIGRATE_MOVABLE][exp]);
+    }
+
+    for (int i = 0; i <= (frame_ents_size - 1) >> PAGEBLOCK_ORDER; ++i) {
+        nr_pageblocks[pageblock_types[i]]++;
+    }
+
+    uart_sync_printf("[buddy] wasted by rounding: %lld pages, "
+                     "returned by exact allocation: %lld pages\r\n",
+                     nr_rounding_waste, nr_exact_returned);
+
+    uart_sync_printf("[buddy] pageblocks: unmovable %d, movable %d, "
+                     "fallbacks %lld, stolen %lld\r\n",
+                     nr_pageblocks[MIGRATE_UNMOVABLE],
+                     nr_pageblocks[MIGRATE_MOVABLE],
+                     nr_fallbacks, nr_pageblocks_stolen);
+
+    uart_sync_printf("[buddy] compaction: success %lld, fail %lld, "
+                     "migrated %lld pages\r\n",
+                     nr_compact_success, nr_compact_fail, nr_pages_migrated);
+
+    spin_unlock_irqrestore(&buddy_lock, daif);
+
+    for (int cpu = 0; cpu < NR_CPUS; ++cpu) {
+        struct per_cpu_pages *pcp = &pcp_lists[cpu];
+
+        if (!cpu_online(cpu)) {
+            continue;
+        }
+
+        uart_sync_printf("[buddy] cpu%d pcp: %d pages, alloc hit %lld, "
+                         "free hit %lld, refill %lld, drain %lld\r\n",
+                         cpu, pcp->count, pcp->alloc_hit, pcp->free_hit,
+                         pcp->refill, pcp->drain);
+    }
 }
 
 #ifdef MM_DEBUG
+#define BUDDY_BENCH_ROUNDS 256
+
 void page_allocator_test(void)
 {
     char *ptr1 = alloc_pages(2);
@@ -287,5 +1184,40 @@ void page_allocator_test(void)
     free_page(ptr1); // Merge with ptr2
     free_page(ptr5);
     free_page(ptr6); // Merge with ptr5, then merge with ptr4, then merge with ptr1
+
+    char *ptr7 = alloc_pages_exact(5); // Return the 3-page tail
+
+    char *ptr8 = alloc_pages(1); // From the tail of ptr7
+
+    free_pages_exact(ptr7);
+    free_page(ptr8); // Merge back to the 8-page block
+
+    // Latency of alloc_pages() / free_page()
+    uint64 t_alloc, t_free, t;
+
+    buddy_quiet = 1;
+
+    for (int exp = 0; exp < 4; ++exp) {
+        t_alloc = 0;
+        t_free = 0;
+
+        for (int i = 0; i < BUDDY_BENCH_ROUNDS; ++i) {
+            void *ptr;
+
+            t = read_sysreg(cntpct_el0);
+            ptr = alloc_pages(1 << exp);
+            t_alloc += read_sysreg(cntpct_el0) - t;
+
+            t = read_sysreg(cntpct_el0);
+            free_page(ptr);
+            t_free += read_sysreg(cntpct_el0) - t;
+        }
+
+        uart_sync_printf("[*] %d pages: alloc %lld ticks, free %lld ticks "
+                         "(%d rounds)\r\n",
+                         1 << exp, t_alloc, t_free, BUDDY_BENCH_ROUNDS);
+    }
+
+    buddy_quiet = 0;
 }
-#endif
\ No newline at end of file
+#endif
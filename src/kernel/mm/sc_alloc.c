@@ -2,17 +2,20 @@
  * Implementation of Small Chunk allocator.
  */
 
-// TODO: Consider critical section
-
 #include <mm/early_alloc.h>
 #include <mm/page_alloc.h>
 #include <mm/sc_alloc.h>
 #include <list.h>
 #include <utils.h>
 #include <mini_uart.h>
+#include <spinlock.h>
+#include <preempt.h>
+#include <current.h>
+#include <irq.h>
+#include <smp.h>
 
 uint32 sc_sizes[] = {
-    0x10, // Minimum size cannot be less than 0x10 (sizeof(sc_hdr))
+    0x10, // Minimum size cannot be less than sizeof(sc_hdr)
     0x20,
     0x30,
     0x40,
@@ -24,19 +27,117 @@ uint32 sc_sizes[] = {
     0x1000 // Maximum size cannot be larger than 0x1000 (PAGE_SIZE)
 };
 
+static const char *sc_names[] = {
+    "kmalloc-0x10",
+    "kmalloc-0x20",
+    "kmalloc-0x30",
+    "kmalloc-0x40",
+    "kmalloc-0x60",
+    "kmalloc-0x80",
+    "kmalloc-0xc0",
+    "kmalloc-0x100",
+    "kmalloc-0x400",
+    "kmalloc-0x1000"
+};
+
+/*
+ * The kmalloc size classes are kmem_caches[0 ~ ARRAY_SIZE(sc_sizes) - 1],
+ * the caches created by kmem_cache_create() follow them.
+ */
+#define SC_CACHE_MAX 32
+
 typedef struct {
-    uint8 size_idx:7;
-    uint8 splitted:1;
-} sc_frame_ent;
+    /* Link to next free chunk in the same page */
+    void *next;
+} sc_hdr;
 
+/*
+ * Every page split by the Small Chunk allocator (a slab) is on one of the
+ * lists of its cache:
+ *   partial: some chunks are allocated
+ *   full   : all chunks are allocated
+ *   empty  : no chunk is allocated
+ */
 typedef struct {
-    /* Link to next free chunk */
+    /* Link to partial / full / empty list of the cache */
     struct list_head list;
-} sc_hdr;
+    /* Free chunks in this page */
+    void *freelist;
+    /* Number of allocated chunks (including chunks held by magazines) */
+    uint16 inuse;
+    uint8 cache_idx:7;
+    uint8 splitted:1;
+} sc_frame_ent;
+
+struct kmem_cache {
+    const char *name;
+    /* Object size requested by the creator */
+    uint32 size;
+    /* Distance between two chunks in a page */
+    uint32 stride;
+    /*
+     * Offset of sc_hdr in a free chunk. It is placed after the object if
+     * the cache has a constructor, so that free chunks stay constructed.
+     */
+    uint32 hdr_offset;
+    /* Number of chunks per page */
+    uint16 nr_chunks;
+    void (*ctor)(void *);
+    struct list_head partial;
+    struct list_head full;
+    struct list_head empty;
+    uint32 nr_empty;
+    /* Number of pages currently split for this cache */
+    uint32 nr_pages;
+    /* Number of allocated chunks (including chunks held by magazines) */
+    uint32 nr_inuse;
+    /* Number of pages returned to the Buddy System */
+    uint64 reclaimed;
+};
+
+/*
+ * Keep at most SC_EMPTY_MAX empty pages per cache, the others are returned
+ * to the Buddy System as soon as they become empty.
+ */
+#define SC_EMPTY_MAX 1
+
+/*
+ * Each CPU keeps a magazine of free chunks per cache. sc_alloc() and
+ * sc_free() only touch the magazine of the running CPU, which needs no lock
+ * and no interrupt masking. An empty magazine is refilled with
+ * SC_MAG_BATCH chunks from the shared slabs (the depot), and a full one
+ * drains SC_MAG_BATCH chunks back.
+ */
+#define SC_MAG_SIZE  16
+#define SC_MAG_BATCH 8
+
+struct sc_magazine {
+    uint32 cnt;
+    void *chunks[SC_MAG_SIZE];
+};
+
+struct sc_cpu_cache {
+    struct sc_magazine mags[SC_CACHE_MAX];
+    /* Served from the magazine */
+    uint64 alloc_fast;
+    uint64 free_fast;
+    /* Served from the depot */
+    uint64 alloc_slow;
+    uint64 free_slow;
+} __attribute__((aligned(64)));
+
+static struct sc_cpu_cache sc_cpu_caches[NR_CPUS];
 
 sc_frame_ent *sc_frame_ents;
 
-struct list_head sc_freelists[ARRAY_SIZE(sc_sizes)];
+static struct kmem_cache kmem_caches[SC_CACHE_MAX];
+static uint32 kmem_caches_cnt;
+
+/*
+ * Protects @kmem_caches (the depot) and @sc_frame_ents.
+ * Lock order: sc_lock -> buddy_lock
+ */
+static spinlock_t sc_lock = SPINLOCK_INIT("sc");
 
 static uint8 find_size_idx(int size)
 {
@@ -54,6 +155,30 @@ static uint8 find_size_idx(int size)
     return -1;
 }
 
+static inline sc_hdr *chunk2hdr(struct kmem_cache *cache, void *chunk)
+{
+    return (sc_hdr *)((char *)chunk + cache->hdr_offset);
+}
+
+static void cache_setup(struct kmem_cache *cache, const char *name,
+                        uint32 size, uint32 stride, uint32 hdr_offset,
+                        void (*ctor)(void *))
+{
+    cache->name = name;
+    cache->size = size;
+    cache->stride = stride;
+    cache->hdr_offset = hdr_offset;
+    cache->nr_chunks = PAGE_SIZE / stride;
+    cache->ctor = ctor;
+    INIT_LIST_HEAD(&cache->partial);
+    INIT_LIST_HEAD(&cache->full);
+    INIT_LIST_HEAD(&cache->empty);
+    cache->nr_empty = 0;
+    cache->nr_pages = 0;
+    cache->nr_inuse = 0;
+    cache->reclaimed = 0;
+}
+
 void sc_early_init(void)
 {
     sc_frame_ents = early_malloc(sizeof(sc_frame_ent) * frame_ents_size);
@@ -66,84 +191,459 @@ void sc_early_init(void)
 void sc_init(void)
 {
     for (int i = 0; i < ARRAY_SIZE(sc_sizes); ++i) {
-        INIT_LIST_HEAD(&sc_freelists[i]);
+        cache_setup(&kmem_caches[i], sc_names[i], sc_sizes[i], sc_sizes[i],
+                    0, NULL);
+    }
+
+    kmem_caches_cnt = ARRAY_SIZE(sc_sizes);
+
+    for (int cpu = 0; cpu < NR_CPUS; ++cpu) {
+        for (int i = 0; i < SC_CACHE_MAX; ++i) {
+            sc_cpu_caches[cpu].mags[i].cnt = 0;
+        }
     }
 }
 
-void *sc_alloc(int size)
+/*
+ * Allocate a page and split it into small chunks.
+ * Must be called with @sc_lock held.
+ */
+static sc_frame_ent *slab_create(uint8 cache_idx)
 {
-    sc_hdr *hdr;
-    uint8 size_idx;
-    
-    size_idx = find_size_idx(size);
+    struct kmem_cache *cache;
+    sc_frame_ent *ent;
+    void *page;
+    int frame_idx;
 
-    if (list_empty(&sc_freelists[size_idx])) {
-        // Allocate a page and split it into small chunks
-        void *page;
-        int frame_idx;
+    cache = &kmem_caches[cache_idx];
+    page = alloc_page();
 
-        page = alloc_page();
+    if (!page) {
+        return NULL;
+    }
 
-        if (!page) {
-            return NULL;
-        }
+    frame_idx = addr2idx(page);
+    ent = &sc_frame_ents[frame_idx];
 
-        frame_idx = addr2idx(page);
-        sc_frame_ents[frame_idx].size_idx = size_idx;
-        sc_frame_ents[frame_idx].splitted = 1;
+    ent->cache_idx = cache_idx;
+    ent->splitted = 1;
+    ent->inuse = 0;
+    ent->freelist = NULL;
 
-        for (int i = 0;
-             i + sc_sizes[size_idx] <= PAGE_SIZE;
-             i += sc_sizes[size_idx]) {
-            hdr = (sc_hdr *)((char *)page + i);
-            list_add_tail(&hdr->list, &sc_freelists[size_idx]);
+    // Push in reverse order, so the chunks are handed out from the start
+    for (int i = cache->nr_chunks - 1; i >= 0; --i) {
+        void *chunk = (char *)page + i * cache->stride;
+
+        if (cache->ctor) {
+            (cache->ctor)(chunk);
         }
 
+        chunk2hdr(cache, chunk)->next = ent->freelist;
+        ent->freelist = chunk;
+    }
+
+    list_add(&ent->list, &cache->empty);
+    cache->nr_empty += 1;
+    cache->nr_pages += 1;
+
+#ifdef MM_DEBUG
+    uart_sync_printf("[sc] Create chunks (page: %d; size: %d)\r\n", 
+                frame_idx, cache->stride);
+#endif
+
+    return ent;
+}
+
+/*
+ * Return an empty page to the Buddy System.
+ * Must be called with @sc_lock held.
+ */
+static void slab_destroy(sc_frame_ent *ent)
+{
+    struct kmem_cache *cache;
+    int frame_idx;
+
+    cache = &kmem_caches[ent->cache_idx];
+    frame_idx = get_elem_idx(ent, sc_frame_ents);
+
+    list_del(&ent->list);
+    cache->nr_empty -= 1;
+    cache->nr_pages -= 1;
+    cache->reclaimed += 1;
+
+    ent->splitted = 0;
+
 #ifdef MM_DEBUG
-        uart_sync_printf("[sc] Create chunks (page: %d; size: %d)\r\n", 
-                    frame_idx, sc_sizes[size_idx]);
+    uart_sync_printf("[sc] Reclaim page %d (size: %d)\r\n", 
+                frame_idx, cache->stride);
 #endif
+
+    free_page(idx2addr(frame_idx));
+}
+
+/*
+ * Take a chunk from the depot.
+ * Must be called with @sc_lock held.
+ */
+static void *depot_alloc(uint8 cache_idx)
+{
+    struct kmem_cache *cache;
+    sc_frame_ent *ent;
+    void *chunk;
+
+    cache = &kmem_caches[cache_idx];
+
+    if (!list_empty(&cache->partial)) {
+        ent = list_first_entry(&cache->partial, sc_frame_ent, list);
+    } else if (!list_empty(&cache->empty)) {
+        ent = list_first_entry(&cache->empty, sc_frame_ent, list);
+    } else {
+        ent = slab_create(cache_idx);
+
+        if (!ent) {
+            return NULL;
+        }
+    }
+
+    if (!ent->inuse) {
+        cache->nr_empty -= 1;
+    }
+
+    chunk = ent->freelist;
+    ent->freelist = chunk2hdr(cache, chunk)->next;
+    ent->inuse += 1;
+    cache->nr_inuse += 1;
+
+    list_del(&ent->list);
+
+    if (ent->inuse == cache->nr_chunks) {
+        list_add(&ent->list, &cache->full);
+    } else {
+        list_add(&ent->list, &cache->partial);
     }
 
-    hdr = list_first_entry(&sc_freelists[size_idx], sc_hdr, list);
-    list_del(&hdr->list);
+    return chunk;
+}
+
+/*
+ * Return a chunk to the depot.
+ * Must be called with @sc_lock held.
+ */
+static void depot_free(void *chunk)
+{
+    struct kmem_cache *cache;
+    sc_frame_ent *ent;
+
+    ent = &sc_frame_ents[addr2idx(chunk)];
+    cache = &kmem_caches[ent->cache_idx];
+
+    chunk2hdr(cache, chunk)->next = ent->freelist;
+    ent->freelist = chunk;
+    ent->inuse -= 1;
+    cache->nr_inuse -= 1;
+
+    list_del(&ent->list);
+
+    if (ent->inuse) {
+        list_add(&ent->list, &cache->partial);
+        return;
+    }
+
+    list_add(&ent->list, &cache->empty);
+    cache->nr_empty += 1;
+
+    if (cache->nr_empty > SC_EMPTY_MAX) {
+        slab_destroy(ent);
+    }
+}
+
+static void mag_refill(struct sc_magazine *mag, uint8 cache_idx)
+{
+    uint32 daif;
+
+    daif = spin_lock_irqsave(&sc_lock);
+
+    while (mag->cnt < SC_MAG_BATCH) {
+        void *chunk = depot_alloc(cache_idx);
+
+        if (!chunk) {
+            break;
+        }
+
+        mag->chunks[mag->cnt++] = chunk;
+    }
+
+    spin_unlock_irqrestore(&sc_lock, daif);
+}
+
+static void mag_drain(struct sc_magazine *mag, uint32 cnt)
+{
+    uint32 daif;
+
+    daif = spin_lock_irqsave(&sc_lock);
+
+    for (int i = 0; i < cnt; ++i) {
+        depot_free(mag->chunks[--mag->cnt]);
+    }
+
+    spin_unlock_irqrestore(&sc_lock, daif);
+}
+
+/*
+ * Magazines are only used in task context. Interrupt handlers (which may
+ * interrupt a magazine operation of the same CPU) and the booting flow
+ * before the first task exists go to the depot directly.
+ */
+static inline int can_use_magazine(void)
+{
+    return current && !in_interrupt();
+}
+
+static void *cache_alloc(uint8 cache_idx)
+{
+    struct sc_cpu_cache *cpu_cache;
+    struct sc_magazine *mag;
+    void *chunk;
+    uint32 daif;
+
+    if (!can_use_magazine()) {
+        daif = spin_lock_irqsave(&sc_lock);
+
+        chunk = depot_alloc(cache_idx);
+
+        spin_unlock_irqrestore(&sc_lock, daif);
+
+        return chunk;
+    }
+
+    preempt_disable();
+
+    cpu_cache = &sc_cpu_caches[smp_processor_id()];
+    mag = &cpu_cache->mags[cache_idx];
+
+    if (!mag->cnt) {
+        mag_refill(mag, cache_idx);
+        cpu_cache->alloc_slow += 1;
+    } else {
+        cpu_cache->alloc_fast += 1;
+    }
+
+    chunk = mag->cnt ? mag->chunks[--mag->cnt] : NULL;
+
+    preempt_enable();
+
+    return chunk;
+}
+
+static void cache_free(void *chunk, uint8 cache_idx)
+{
+    struct sc_cpu_cache *cpu_cache;
+    struct sc_magazine *mag;
+    uint32 daif;
+
+    if (!can_use_magazine()) {
+        daif = spin_lock_irqsave(&sc_lock);
+
+        depot_free(chunk);
+
+        spin_unlock_irqrestore(&sc_lock, daif);
+
+        return;
+    }
+
+    preempt_disable();
+
+    cpu_cache = &sc_cpu_caches[smp_processor_id()];
+    mag = &cpu_cache->mags[cache_idx];
+
+    if (mag->cnt == SC_MAG_SIZE) {
+        mag_drain(mag, SC_MAG_BATCH);
+        cpu_cache->free_slow += 1;
+    } else {
+        cpu_cache->free_fast += 1;
+    }
+
+    mag->chunks[mag->cnt++] = chunk;
+
+    preempt_enable();
+}
+
+void *sc_alloc(int size)
+{
+    void *chunk;
+    uint8 size_idx;
+    
+    size_idx = find_size_idx(size);
+
+    chunk = cache_alloc(size_idx);
 
 #ifdef MM_DEBUG
     uart_sync_printf("[sc] Allocate chunks %llx (request: %d; chunksize: %d)\r\n", 
-                hdr,
+                chunk,
                 size,
                 sc_sizes[size_idx]);
 #endif
 
-    return hdr;
+    return chunk;
 }
 
 int sc_free(void *sc)
 {
-    sc_hdr *hdr;
-    int frame_idx, size_idx;
+    int frame_idx, cache_idx;
 
     frame_idx = addr2idx(sc);
 
+    /*
+     * @splitted of the frame can't change while one of its chunks is
+     * still allocated, no lock needed here.
+     */
     if (!sc_frame_ents[frame_idx].splitted) {
         /* This frame isn't managed by the Small Chunk allocator */
         return -1;
     }
 
-    size_idx = sc_frame_ents[frame_idx].size_idx;
-
-    hdr = (sc_hdr *)sc;
-    list_add(&hdr->list, &sc_freelists[size_idx]);
+    cache_idx = sc_frame_ents[frame_idx].cache_idx;
 
 #ifdef MM_DEBUG
     uart_sync_printf("[sc] Free chunks %llx(size: %d)\r\n", 
                 sc,
-                sc_sizes[size_idx]);
+                kmem_caches[cache_idx].stride);
 #endif
 
+    cache_free(sc, cache_idx);
+
     return 0;
 }
 
+struct kmem_cache *kmem_cache_create(const char *name, uint32 size,
+                                     uint32 align, void (*ctor)(void *))
+{
+    struct kmem_cache *cache;
+    uint32 hdr_offset, stride;
+    uint32 daif;
+
+    if (align < sizeof(sc_hdr)) {
+        align = sizeof(sc_hdr);
+    }
+
+    if (align & (align - 1)) {
+        return NULL;
+    }
+
+    if (ctor) {
+        hdr_offset = ALIGN(size, sizeof(sc_hdr));
+        stride = hdr_offset + sizeof(sc_hdr);
+    } else {
+        hdr_offset = 0;
+        stride = size < sizeof(sc_hdr) ? sizeof(sc_hdr) : size;
+    }
+
+    stride = ALIGN(stride, align);
+
+    if (stride > PAGE_SIZE) {
+        return NULL;
+    }
+
+    daif = spin_lock_irqsave(&sc_lock);
+
+    if (kmem_caches_cnt == SC_CACHE_MAX) {
+        spin_unlock_irqrestore(&sc_lock, daif);
+
+        return NULL;
+    }
+
+    cache = &kmem_caches[kmem_caches_cnt];
+    cache_setup(cache, name, size, stride, hdr_offset, ctor);
+    kmem_caches_cnt += 1;
+
+    spin_unlock_irqrestore(&sc_lock, daif);
+
+    return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    return cache_alloc(get_elem_idx(cache, kmem_caches));
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    if (!obj) {
+        return;
+    }
+
+    cache_free(obj, get_elem_idx(cache, kmem_caches));
+}
+
+int sc_shrink(void)
+{
+    struct kmem_cache *cache;
+    sc_frame_ent *ent, *tmp;
+    uint32 daif;
+    int reclaimed;
+
+    // Chunks held by the magazines of this CPU keep their pages in use
+    if (can_use_magazine()) {
+        preempt_disable();
+
+        for (int i = 0; i < SC_CACHE_MAX; ++i) {
+            struct sc_magazine *mag;
+
+            mag = &sc_cpu_caches[smp_processor_id()].mags[i];
+            mag_drain(mag, mag->cnt);
+        }
+
+        preempt_enable();
+    }
+
+    reclaimed = 0;
+
+    daif = spin_lock_irqsave(&sc_lock);
+
+    for (int i = 0; i < kmem_caches_cnt; ++i) {
+        cache = &kmem_caches[i];
+
+        list_for_each_entry_safe(ent, tmp, &cache->empty, list) {
+            slab_destroy(ent);
+            reclaimed += 1;
+        }
+    }
+
+    spin_unlock_irqrestore(&sc_lock, daif);
+
+    return reclaimed;
+}
+
+void sc_stat_show(void)
+{
+    for (int cpu = 0; cpu < NR_CPUS; ++cpu) {
+        struct sc_cpu_cache *cpu_cache = &sc_cpu_caches[cpu];
+
+        if (!cpu_online(cpu)) {
+            continue;
+        }
+
+        uart_sync_printf("[sc] cpu%d alloc: %lld fast %lld slow, "
+                         "free: %lld fast %lld slow\r\n",
+                         cpu,
+                         cpu_cache->alloc_fast, cpu_cache->alloc_slow,
+                         cpu_cache->free_fast, cpu_cache->free_slow);
+    }
+
+    uart_sync_printf("[sc] name: size stride chunks/page pages "
+                     "(empty) inuse/total reclaimed\r\n");
+
+    for (int i = 0; i < kmem_caches_cnt; ++i) {
+        struct kmem_cache *cache = &kmem_caches[i];
+
+        uart_sync_printf("[sc] %s: %d %d %d %d (%d) %d/%d %lld\r\n",
+                         cache->name, cache->size, cache->stride,
+                         cache->nr_chunks, cache->nr_pages, cache->nr_empty,
+                         cache->nr_inuse, cache->nr_pages * cache->nr_chunks,
+                         cache->reclaimed);
+    }
+}
+
 #ifdef MM_DEBUG
 void sc_test(void)
 {
@@ -174,14 +674,14 @@ void sc_test(void)
     sc_free(ptr1);
     sc_free(ptr2);
     sc_free(ptr3);
-    sc_free(ptr5);
-    sc_free(ptr4);
-
-    ptr1 = sc_alloc(0x3f0); // D
-    ptr2 = sc_alloc(0x3f0); // E
-    ptr3 = sc_alloc(0x3f0); // C
-    ptr4 = sc_alloc(0x3f0); // B
-    ptr5 = sc_alloc(0x3f0); // A
+    sc_free(ptr5); // The page of E is empty, keep it
+    sc_free(ptr4); // The page of A ~ D is empty, reclaim it
+
+    ptr1 = sc_alloc(0x3f0); // E
+    ptr2 = sc_alloc(0x3f0); // F; F ~ H are the rest chunks of the page of E
+    ptr3 = sc_alloc(0x3f0); // G
+    ptr4 = sc_alloc(0x3f0); // H
+    ptr5 = sc_alloc(0x3f0); // Allocate a page and create 0x400 chunks
 
     sc_free(ptr1);
     sc_free(ptr2);
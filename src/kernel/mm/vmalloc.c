@@ -0,0 +1,223 @@
+#include <mm/mm.h>
+#include <mmu.h>
+#include <asid.h>
+#include <list.h>
+#include <utils.h>
+#include <spinlock.h>
+#include <mini_uart.h>
+
+/*
+ * The freed ranges keep their addresses until this many pages of them
+ * wait for the TLB purge.
+ */
+#define VMALLOC_LAZY_MAX    256
+
+struct vmap_area {
+    /* @list links all vmap_area, sorted by @addr */
+    struct list_head list;
+    uint64 addr;
+    uint32 nr_pages;
+    /* Freed, the TLB may still hold its entries */
+    int lazy;
+};
+
+static struct list_head vmap_areas;
+
+static uint32 nr_vmalloc_pages;
+static uint32 nr_lazy_pages;
+static uint32 nr_purges;
+
+/* Protects @vmap_areas and the kernel page table of the vmalloc range */
+static spinlock_t vmalloc_lock = SPINLOCK_INIT("vmalloc");
+
+/*
+ * Flush the TLB entries of the lazy areas and release their addresses.
+ * Must be called with @vmalloc_lock held.
+ */
+static void purge_lazy_areas(void)
+{
+    struct vmap_area *area, *tmp;
+    uint64 start = VMALLOC_END, end = VMALLOC_START;
+
+    if (!nr_lazy_pages) {
+        return;
+    }
+
+    list_for_each_entry(area, &vmap_areas, list) {
+        if (!area->lazy) {
+            continue;
+        }
+
+        if (area->addr < start) {
+            start = area->addr;
+        }
+
+        if (area->addr + area->nr_pages * PAGE_SIZE > end) {
+            end = area->addr + area->nr_pages * PAGE_SIZE;
+        }
+    }
+
+    flush_tlb_kernel_range(start, end);
+
+    list_for_each_entry_safe(area, tmp, &vmap_areas, list) {
+        if (area->lazy) {
+            list_del(&area->list);
+            kfree(area);
+        }
+    }
+
+    nr_lazy_pages = 0;
+    nr_purges++;
+}
+
+/*
+ * Find the lowest free range of @nr_pages pages and a guard page, link a
+ * vmap_area of it. Return NULL if there is none.
+ * Must be called with @vmalloc_lock held.
+ */
+static struct vmap_area *alloc_vmap_area(uint32 nr_pages)
+{
+    struct vmap_area *area, *new;
+    uint64 addr, size;
+
+    size = (uint64)(nr_pages + 1) * PAGE_SIZE;
+    addr = VMALLOC_START;
+
+    list_for_each_entry(area, &vmap_areas, list) {
+        if (addr + size <= area->addr) {
+            break;
+        }
+
+        addr = area->addr + (uint64)(area->nr_pages + 1) * PAGE_SIZE;
+    }
+
+    if (addr + size > VMALLOC_END) {
+        return NULL;
+    }
+
+    new = kmalloc(sizeof(struct vmap_area));
+
+    if (!new) {
+        return NULL;
+    }
+
+    new->addr = addr;
+    new->nr_pages = nr_pages;
+    new->lazy = 0;
+
+    // Before @area, or at the tail if the loop ran through
+    list_add_tail(&new->list, &area->list);
+
+    return new;
+}
+
+void vmalloc_init(void)
+{
+    INIT_LIST_HEAD(&vmap_areas);
+}
+
+void *vmalloc(uint64 size)
+{
+    struct vmap_area *area;
+    uint32 nr_pages, daif;
+
+    nr_pages = ALIGN(size, PAGE_SIZE) / PAGE_SIZE;
+
+    if (!nr_pages) {
+        return NULL;
+    }
+
+    daif = spin_lock_irqsave(&vmalloc_lock);
+
+    area = alloc_vmap_area(nr_pages);
+
+    if (!area) {
+        // The addresses of the lazy areas are reusable after the purge
+        purge_lazy_areas();
+        area = alloc_vmap_area(nr_pages);
+    }
+
+    if (!area) {
+        spin_unlock_irqrestore(&vmalloc_lock, daif);
+        return NULL;
+    }
+
+    for (uint32 i = 0; i < nr_pages; ++i) {
+        void *page = alloc_page();
+
+        // Out of pages, or of the kernel tables to map it
+        if (page &&
+            kernel_map_page(area->addr + i * PAGE_SIZE, VA2PA(page))) {
+            free_page(page);
+            page = NULL;
+        }
+
+        if (!page) {
+            // Unmap the pages so far, the range has never been accessed
+            while (i--) {
+                uint64 pa = kernel_unmap_page(area->addr + i * PAGE_SIZE);
+
+                free_page((void *)PA2VA(pa));
+            }
+
+            list_del(&area->list);
+            kfree(area);
+
+            spin_unlock_irqrestore(&vmalloc_lock, daif);
+            return NULL;
+        }
+    }
+
+    nr_vmalloc_pages += nr_pages;
+
+    spin_unlock_irqrestore(&vmalloc_lock, daif);
+
+    return (void *)area->addr;
+}
+
+void vfree(void *addr)
+{
+    struct vmap_area *area;
+    uint32 daif;
+
+    if (!addr) {
+        return;
+    }
+
+    daif = spin_lock_irqsave(&vmalloc_lock);
+
+    list_for_each_entry(area, &vmap_areas, list) {
+        if (area->addr == (uint64)addr && !area->lazy) {
+            break;
+        }
+    }
+
+    if (&area->list == &vmap_areas) {
+        // Not allocated by vmalloc()
+        spin_unlock_irqrestore(&vmalloc_lock, daif);
+        return;
+    }
+
+    for (uint32 i = 0; i < area->nr_pages; ++i) {
+        uint64 pa = kernel_unmap_page(area->addr + i * PAGE_SIZE);
+
+        free_page((void *)PA2VA(pa));
+    }
+
+    area->lazy = 1;
+
+    nr_vmalloc_pages -= area->nr_pages;
+    nr_lazy_pages += area->nr_pages;
+
+    if (nr_lazy_pages > VMALLOC_LAZY_MAX) {
+        purge_lazy_areas();
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, daif);
+}
+
+void vmalloc_stat_show(void)
+{
+    uart_sync_printf("[vmalloc] pages: %d, lazy pages: %d, purges: %d\r\n",
+                     nr_vmalloc_pages, nr_lazy_pages, nr_purges);
+}
@@ -0,0 +1,92 @@
+#include <mm/mm.h>
+#include <utils.h>
+#include <spinlock.h>
+#include <mini_uart.h>
+
+/*
+ * Pages zeroed while the core is idle, so that the anonymous page faults
+ * don't have to zero them.
+ */
+#ifndef ZERO_POOL_PAGES
+#define ZERO_POOL_PAGES 64
+#endif
+
+static void *zero_pool[ZERO_POOL_PAGES];
+static uint32 zero_pool_cnt;
+
+static uint32 zero_pool_hits;
+static uint32 zero_pool_misses;
+
+static spinlock_t zero_pool_lock = SPINLOCK_INIT("zero_pool");
+
+void *zero_page_alloc(void)
+{
+    void *page = NULL;
+    uint32 daif;
+
+    daif = spin_lock_irqsave(&zero_pool_lock);
+
+    if (zero_pool_cnt) {
+        page = zero_pool[--zero_pool_cnt];
+        zero_pool_hits++;
+    } else {
+        zero_pool_misses++;
+    }
+
+    spin_unlock_irqrestore(&zero_pool_lock, daif);
+
+    if (page) {
+        return page;
+    }
+
+    page = alloc_page_movable();
+
+    if (page) {
+        clear_page(page);
+    }
+
+    return page;
+}
+
+int zero_pool_refill(void)
+{
+    void *page;
+    uint32 daif;
+
+    if (__atomic_load_n(&zero_pool_cnt, __ATOMIC_RELAXED) >= ZERO_POOL_PAGES) {
+        return 0;
+    }
+
+    page = alloc_page_movable();
+
+    if (!page) {
+        return 0;
+    }
+
+    // Zero it outside of the lock
+    clear_page(page);
+
+    daif = spin_lock_irqsave(&zero_pool_lock);
+
+    if (zero_pool_cnt < ZERO_POOL_PAGES) {
+        zero_pool[zero_pool_cnt++] = page;
+        page = NULL;
+    }
+
+    spin_unlock_irqrestore(&zero_pool_lock, daif);
+
+    if (page) {
+        // Filled by the others in the meantime
+        free_page(page);
+        return 0;
+    }
+
+    return 1;
+}
+
+void zero_pool_stat_show(void)
+{
+    uart_sync_printf("[zero pool] pages: %d/%d, hits: %d, misses: %d\r\n",
+                     zero_pool_cnt, ZERO_POOL_PAGES,
+                     zero_pool_hits, zero_pool_misses);
+}
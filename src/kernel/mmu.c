@@ -8,33 +8,110 @@
 #include <task.h>
 #include <current.h>
 #include <mm/mm.h>
+#include <cache.h>
+#include <asid.h>
+#include <fs/vfs.h>
 
 #define TCR_CONFIG_REGION_48bit (((64 - 48) << 0) | ((64 - 48) << 16))
 #define TCR_CONFIG_4KB          ((0b00 << 14) |  (0b10 << 30))
+// Table walks: Inner/Outer Write-Back Read/Write-Allocate, Inner Shareable
+#define TCR_CONFIG_WALK_WBWA    ((0b01 << 8) | (0b01 << 10) | (0b11 << 12) | \
+                                 (0b01 << 24) | (0b01 << 26) | (0b11 << 28))
+// 16-bit ASID, if supported
+#define TCR_AS                  ((uint64)1 << 36)
+
+#ifdef MMU_NOCACHE
 #define TCR_CONFIG_DEFAULT      (TCR_CONFIG_REGION_48bit | TCR_CONFIG_4KB)
+#else
+#define TCR_CONFIG_DEFAULT      (TCR_CONFIG_REGION_48bit | TCR_CONFIG_4KB | \
+                                 TCR_CONFIG_WALK_WBWA)
+#endif
 
 #define MAIR_DEVICE_nGnRnE  0b00000000
 #define MAIR_NORMAL_NOCACHE 0b01000100
+#define MAIR_NORMAL_WBWA    0b11111111
 #define MAIR_IDX_DEVICE_nGnRnE  0
 #define MAIR_IDX_NORMAL_NOCACHE 1
+#define MAIR_IDX_NORMAL_WBWA    2
+
+#define SCTLR_M     (1 << 0)
+#define SCTLR_C     (1 << 2)
+#define SCTLR_I     (1 << 12)
+
+/*
+ * Build with MMU_NOCACHE=1 to run normal memory non-cacheable as before,
+ * e.g. to compare the throughput of a workload with caches on and off.
+ */
+#ifdef MMU_NOCACHE
+#define MAIR_IDX_NORMAL MAIR_IDX_NORMAL_NOCACHE
+#define SCTLR_CONFIG    (SCTLR_M)
+#else
+#define MAIR_IDX_NORMAL MAIR_IDX_NORMAL_WBWA
+#define SCTLR_CONFIG    (SCTLR_M | SCTLR_C | SCTLR_I)
+#endif
 
 #define PD_TABLE    0b11
 #define PD_BLOCK    0b01
+#define PD_SH_INNER     (0b11 << 8)
 #define PD_ACCESS       (1 << 10)
+// Not global: tagged with the ASID
+#define PD_NG           (1 << 11)
 #define PD_PXN          ((uint64)1 << 53)
+#define PD_UXN          ((uint64)1 << 54)
 #define PD_NSTABLE      ((uint64)1 << 63)
 #define PD_UXNTABLE     ((uint64)1 << 60)
-#define PD_MAIR_DEVICE_IDX (MAIR_IDX_DEVICE_nGnRnE << 2)
-#define PD_MAIR_NORMAL_IDX (MAIR_IDX_NORMAL_NOCACHE << 2)
+// AP[1]: Accessible from EL0
+#define PD_USER         (1 << 6)
+// AP[2]: Read-only
+#define PD_RDONLY       (1 << 7)
+#define PD_ADDR(pd)     ((pd) & 0x0000fffffffff000)
+#define PD_IS_TABLE(pd) (((pd) & 0b11) == PD_TABLE)
+// Address bits translated by the level 0 ~ 3 entries, and their size
+#define PD_LEVEL_SHIFT(level)   (12 + 9 * (3 - (level)))
+#define PD_LEVEL_SIZE(level)    ((uint64)1 << PD_LEVEL_SHIFT(level))
+/*
+ * Called on a valid leaf entry @pd that maps @va at @level, see
+ * pt_for_each(). @va is not aligned to the block if the range starts
+ * inside it.
+ */
+typedef void (*pt_leaf_f)(pd_t *pd, uint64 va, int level, void *arg);
+
+// Software bit: written since mapped, see VMA_SHARED
+#define PD_DIRTY        ((uint64)1 << 55)
+// Software bit: write-protected while the page moves, see migrate_user_pages()
+#define PD_MIGRATE      ((uint64)1 << 56)
+#define PD_MAIR_DEVICE_IDX  (MAIR_IDX_DEVICE_nGnRnE << 2)
+#define PD_MAIR_NOCACHE_IDX (MAIR_IDX_NORMAL_NOCACHE << 2)
+#define PD_MAIR_NORMAL_IDX  (MAIR_IDX_NORMAL << 2)
 // Block Entry
 #define PD_BE PD_ACCESS | PD_BLOCK
 // Level 3 Block Entry
 #define PD_L3BE PD_ACCESS | PD_TABLE
 
+/*
+ * A fault in a VMA_KVA / VMA_PA region also maps the resident pages of the
+ * FAULT_AROUND_PAGES aligned window around it.
+ */
+#ifndef FAULT_AROUND_PAGES
+#define FAULT_AROUND_PAGES 16
+#endif
+
+#if FAULT_AROUND_PAGES & (FAULT_AROUND_PAGES - 1)
+#error "FAULT_AROUND_PAGES must be a power of 2"
+#endif
+
 #define BOOT_PGD ((pd_t *)0x1000)
 #define BOOT_PUD ((pd_t *)0x2000)
 #define BOOT_PMD ((pd_t *)0x3000)
 
+static struct kmem_cache *vma_cache;
+
+/* Number of pages used by the page tables of all tasks */
+static uint32 nr_pt_pages;
+
+/* Number of pages used by the kernel tables below BOOT_PGD (vmalloc) */
+static uint32 nr_kernel_pt_pages;
+
 static void segmentation_fault(void)
 {
     uart_sync_printf("[Segmentation fault]: Kill Process\r\n");
@@ -43,23 +120,244 @@ static void segmentation_fault(void)
     // Never reach
 }
 
+void vma_init(void)
+{
+    vma_cache = kmem_cache_create("vm_area_t", sizeof(vm_area_t), 8, NULL);
+}
+
+/*
+ * Return the entry mapping @va and set @level to its level: a level 3 page
+ * entry, or a level 1 (1GB) / level 2 (2MB) block entry. Return NULL if
+ * there is no table down to @va.
+ */
+static pd_t *pt_lookup(pd_t *pt, uint64 va, int *level)
+{
+    pd_t pd;
+    int idx;
+
+    for (int lv = 0; lv < 3; ++lv) {
+        idx = (va >> PD_LEVEL_SHIFT(lv)) & 0b111111111;
+        pd = pt[idx];
+
+        if (!(pd & 1)) {
+            return NULL;
+        }
+
+        if (!PD_IS_TABLE(pd)) {
+            // Block entry
+            *level = lv;
+            return &pt[idx];
+        }
+
+        pt = (pd_t *)PA2VA(PD_ADDR(pd));
+    }
+
+    *level = 3;
+
+    return &pt[(va >> PD_LEVEL_SHIFT(3)) & 0b111111111];
+}
+
+/*
+ * Allocate an empty table counted in @nr_pages. Return NULL if failed.
+ */
+static pd_t *pt_alloc(uint32 *nr_pages)
+{
+    pd_t *pt = kmalloc(PAGE_TABLE_SIZE);
+
+    if (!pt) {
+        return NULL;
+    }
+
+    for (int i = 0; i < PAGE_TABLE_SIZE / sizeof(pt[0]); ++i) {
+        pt[i] = 0;
+    }
+
+    __atomic_fetch_add(nr_pages, 1, __ATOMIC_RELAXED);
+
+    return pt;
+}
+
+/*
+ * Return the level @level entry of @va, create the missing tables. Return
+ * NULL if @va is mapped by a block above @level, or a table can't be
+ * allocated.
+ */
+static pd_t *pt_walk(pd_t *pt, uint64 va, int level)
+{
+    pd_t pd;
+    int idx;
+
+    // 47 ~ 39, 38 ~ 30, 29 ~ 21, 20 ~ 12
+    for (int lv = 0; lv < level; ++lv) {
+        idx = (va >> PD_LEVEL_SHIFT(lv)) & 0b111111111;
+        pd = pt[idx];
+
+        if (!(pd & 1)) {
+            // Invalid entry, the kernel addresses are in the TTBR1 tables
+            pd_t *tmp = pt_alloc(va >= USER_VA_END ? &nr_kernel_pt_pages :
+                                                     &nr_pt_pages);
+
+            if (!tmp) {
+                return NULL;
+            }
+
+            pt[idx] = VA2PA(tmp) | PD_TABLE;
+            pt = tmp;
+            continue;
+        }
+
+        if (!PD_IS_TABLE(pd)) {
+            return NULL;
+        }
+
+        pt = (pd_t *)PA2VA(PD_ADDR(pd));
+    }
+
+    return &pt[(va >> PD_LEVEL_SHIFT(level)) & 0b111111111];
+}
+
+/*
+ * Replace the level @level block entry @pd of the running task with a
+ * table of entries of the next level, with the same attributes. Return -1
+ * if the table can't be allocated.
+ */
+static int pt_split_block(pd_t *pd, int level)
+{
+    pd_t *table;
+    uint64 attr, pa, size;
+
+    table = pt_create();
+
+    if (!table) {
+        return -1;
+    }
+
+    pa = PD_ADDR(*pd);
+    attr = *pd & ~PD_ADDR(*pd) & ~(uint64)0b11;
+    size = PD_LEVEL_SIZE(level + 1);
+
+    for (int i = 0; i < PAGE_TABLE_SIZE / sizeof(table[0]); ++i) {
+        table[i] = (pa + i * size) | attr |
+                   (level + 1 == 3 ? PD_TABLE : PD_BLOCK);
+    }
+
+    // Break-before-make
+    *pd = 0;
+    flush_tlb_mm(current);
+
+    *pd = VA2PA(table) | PD_TABLE;
+
+    return 0;
+}
+
+/*
+ * Same as pt_lookup(), but split the blocks down to the level 3 entry of
+ * @va, NULL is also returned if a block can't be split. @pt must be the
+ * page table of the running task.
+ */
+static pd_t *pt_lookup_page(pd_t *pt, uint64 va)
+{
+    pd_t *pd;
+    int level;
+
+    while ((pd = pt_lookup(pt, va, &level)) && level != 3) {
+        if (pt_split_block(pd, level)) {
+            return NULL;
+        }
+    }
+
+    return pd;
+}
+
+/*
+ * Split the block entry containing @va, if any, so that the entries of the
+ * running task's @pt start or end at @va. Return -1 if a block can't be
+ * split.
+ */
+static int pt_split_at(pd_t *pt, uint64 va)
+{
+    pd_t *pd;
+    int level;
+
+    if (va >= USER_VA_END) {
+        return 0;
+    }
+
+    while ((pd = pt_lookup(pt, va, &level)) && level != 3 &&
+           va & (PD_LEVEL_SIZE(level) - 1)) {
+        if (pt_split_block(pd, level)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void _pt_for_each(pd_t *table, int level, uint64 begin, uint64 end,
+                         pt_leaf_f f, void *arg)
+{
+    uint64 next;
+    pd_t *pd;
+
+    for (uint64 va = begin; va < end; va = next) {
+        next = ALIGN_DOWN(va, PD_LEVEL_SIZE(level)) + PD_LEVEL_SIZE(level);
+
+        if (next > end) {
+            next = end;
+        }
+
+        pd = &table[(va >> PD_LEVEL_SHIFT(level)) & 0b111111111];
+
+        if (!(*pd & 1)) {
+            // Nothing mapped below
+            continue;
+        }
+
+        if (level < 3 && PD_IS_TABLE(*pd)) {
+            _pt_for_each((pd_t *)PA2VA(PD_ADDR(*pd)), level + 1, va, next,
+                         f, arg);
+        } else {
+            f(pd, va, level, arg);
+        }
+    }
+}
+
+/*
+ * Call @f on each valid page and block entry of @pt mapping [@begin, @end).
+ * The empty subtrees are skipped as a whole, so the cost follows the
+ * resident pages instead of the size of the range.
+ */
+static void pt_for_each(pd_t *pt, uint64 begin, uint64 end, pt_leaf_f f,
+                        void *arg)
+{
+    _pt_for_each(pt, 0, begin, end, f, arg);
+}
+
 static vm_area_t *vma_create(void *va, uint64 size, uint64 flag, void *addr)
 {
     vm_area_t *vma;
 
-    vma = kmalloc(sizeof(vm_area_t));
+    vma = kmem_cache_alloc(vma_cache);
     size = ALIGN(size, PAGE_SIZE);
 
     vma->va_begin = (uint64)va;
     vma->va_end = (uint64)va + size;
     vma->flag = flag;
 
+    vma->vnode = NULL;
+    vma->file_offset = 0;
+
     if (vma->flag & VMA_ANON) {
         vma->kva = 0;
+    } else if (vma->flag & VMA_FILE) {
+        vma->kva = 0;
+        vma->vnode = addr;
     } else if (vma->flag & VMA_PA) {
         vma->kva = PA2VA(addr);
     } else if (vma->flag & VMA_KVA) {
         vma->kva = (uint64)addr;
+        // Number of vm_area_t sharing the block, see vma_clone()
+        page_ref_init((void *)vma->kva);
     } else {
         // Unexpected
         panic("vma_create flag error");
@@ -68,60 +366,97 @@ static vm_area_t *vma_create(void *va, uint64 size, uint64 flag, void *addr)
     return vma;
 }
 
-static void clone_uva_region(uint64 uva_begin, uint64 uva_end,
-                             pd_t *pt, uint64 flag)
+/*
+ * Return 1 if @kva belongs to the block of a VMA_KVA @vma. The pages of the
+ * block are not counted one by one, the whole block is shared by
+ * page_refs of its first page instead.
+ */
+static inline int is_block_page(vm_area_t *vma, uint64 kva)
 {
-    for (uint64 addr = uva_begin; addr < uva_end; addr += PAGE_SIZE) {
-        void *new_kva;
-        uint64 par;
+    return vma->flag & VMA_KVA && vma->kva <= kva &&
+           kva < vma->kva + (vma->va_end - vma->va_begin);
+}
 
-        // try to get the PA of UVA
-        asm volatile (
-            "at s1e0r, %0"
-            :: "r" (addr)
-        );
+/*
+ * Return 1 if the page @kva mapped by @vma is shared with another address
+ * space.
+ */
+static int is_shared_page(vm_area_t *vma, uint64 kva)
+{
+    if (is_block_page(vma, kva)) {
+        return page_ref_count((void *)vma->kva) > 1;
+    }
 
-        par = read_sysreg(PAR_EL1);
+    return page_ref_count((void *)kva) > 1;
+}
 
-        if (PAR_FAILED(par)) {
-            // VA to PA conversion aborted
-            continue;
-        }
+struct share_arg {
+    vm_area_t *vma;
+    pd_t *to_pt;
+};
 
-        // convert PA to KVA
-        par = PA2VA(PAR_PA(par));
+static void share_leaf(pd_t *pd, uint64 va, int level, void *arg)
+{
+    struct share_arg *share = arg;
+    uint64 kva;
+    pd_t *to;
 
-        // Allocate a page and copy content to this page
-        new_kva = kmalloc(PAGE_SIZE);
-        memncpy(new_kva, (void *)par, PAGE_SIZE);
+    to = pt_walk(share->to_pt, va, level);
 
-        // map @new_kva into @pt
-        pt_map(pt, (void *)addr, PAGE_SIZE, (void *)VA2PA(new_kva), flag);
+    // Out of memory, the page is left to the parent
+    if (!to) {
+        return;
+    }
+
+    kva = PA2VA(PD_ADDR(*pd));
+
+    // A block entry is shared as a whole
+    if (!is_block_page(share->vma, kva)) {
+        page_ref_inc((void *)kva);
     }
+
+    if (!(share->vma->flag & VMA_SHARED)) {
+        *pd |= PD_RDONLY;
+    }
+
+    *to = *pd;
 }
 
-static vm_area_t *vma_clone(vm_area_t *vma, pd_t *page_table)
+/*
+ * Share the pages mapped in @from_pt with @to_pt. Both mappings become
+ * read-only, the first write breaks the sharing, see do_wp_page(). The
+ * pages of a VMA_SHARED @vma stay shared.
+ */
+static void share_uva_region(vm_area_t *vma, pd_t *to_pt, pd_t *from_pt)
+{
+    struct share_arg share = {
+        .vma = vma,
+        .to_pt = to_pt,
+    };
+
+    pt_for_each(from_pt, vma->va_begin, vma->va_end, share_leaf, &share);
+}
+
+static vm_area_t *vma_clone(vm_area_t *vma, pd_t *to_pt, pd_t *from_pt)
 {
     vm_area_t *new_vma;
 
-    new_vma = kmalloc(sizeof(vm_area_t));
+    new_vma = kmem_cache_alloc(vma_cache);
 
     new_vma->va_begin = vma->va_begin;
     new_vma->va_end = vma->va_end;
     new_vma->flag = vma->flag;
+    new_vma->kva = vma->kva;
+    new_vma->vnode = vma->vnode;
+    new_vma->file_offset = vma->file_offset;
 
-    if (vma->flag & VMA_ANON) {
-        clone_uva_region(vma->va_begin, vma->va_end, page_table, vma->flag);
-        new_vma->kva = 0;
+    if (vma->flag & (VMA_ANON | VMA_FILE)) {
+        share_uva_region(vma, to_pt, from_pt);
     } else if (vma->flag & VMA_PA) {
-        new_vma->kva = vma->kva;
+        // Faulted in again by the child
     } else if (vma->flag & VMA_KVA) {
-        void *new_kva;
-        
-        new_kva = kmalloc(vma->va_end - vma->va_begin);
-        memncpy(new_kva, (void *)vma->kva, vma->va_end - vma->va_begin);
-
-        new_vma->kva = (uint64)new_kva;
+        page_ref_inc((void *)vma->kva);
+        share_uva_region(vma, to_pt, from_pt);
     } else {
         // Unexpected
         panic("vma_clone flag error");
@@ -130,71 +465,438 @@ static vm_area_t *vma_clone(vm_area_t *vma, pd_t *page_table)
     return new_vma;
 }
 
-static void free_uva_region(uint64 uva_begin, uint64 uva_end)
+struct free_arg {
+    vm_area_t *vma;
+    int written;
+};
+
+static void free_leaf(pd_t *pd, uint64 va, int level, void *arg)
 {
-    for (uint64 addr = uva_begin; addr < uva_end; addr += PAGE_SIZE) {
-        uint64 par;
+    struct free_arg *free = arg;
+    vm_area_t *vma = free->vma;
+    uint64 kva;
 
-        // try to get the PA of UVA
-        asm volatile (
-            "at s1e0r, %0"
-            :: "r" (addr)
-        );
+    kva = PA2VA(PD_ADDR(*pd));
 
-        par = read_sysreg(PAR_EL1);
+    if (vma->flag & VMA_SHARED && *pd & PD_DIRTY) {
+        vfs_writepage(vma->vnode, (void *)kva,
+                      vma->file_offset + va - vma->va_begin);
+        free->written++;
+    }
 
-        if (PAR_FAILED(par)) {
-            // VA to PA conversion aborted
-            continue;
-        }
+    *pd = 0;
 
-        // convert PA to KVA
-        par = PA2VA(PAR_PA(par));
+    // Block entries only map the block of a VMA_KVA / VMA_PA region, the
+    // pages of a VMA_PA region aren't counted
+    if (vma->flag & VMA_PA || is_block_page(vma, kva)) {
+        return;
+    }
 
-        // free KVA
-        kfree((void *)par);
+    if (!page_ref_dec((void *)kva)) {
+        kfree((void *)kva);
     }
 }
 
-static void vma_free(vm_area_t *vma)
+/*
+ * Unmap and release the pages of @vma in @begin ~ @end. The dirty pages of
+ * a VMA_SHARED file mapping are written back to the file first, return
+ * their count.
+ */
+static int free_uva_range(vm_area_t *vma, pd_t *pt, uint64 begin,
+                          uint64 end)
+{
+    struct free_arg free = {
+        .vma = vma,
+        .written = 0,
+    };
+
+    pt_for_each(pt, begin, end, free_leaf, &free);
+
+    return free.written;
+}
+
+static int free_uva_region(vm_area_t *vma, pd_t *pt)
 {
-    if (vma->kva && vma->flag & VMA_KVA) {
-        kfree((void *)vma->kva);
+    return free_uva_range(vma, pt, vma->va_begin, vma->va_end);
+}
+
+static void vma_free(vm_area_t *vma, pd_t *pt)
+{
+    if (vma->flag & VMA_KVA) {
+        free_uva_region(vma, pt);
+
+        if (!page_ref_dec((void *)vma->kva)) {
+            kfree((void *)vma->kva);
+        }
     } else if (vma->flag & VMA_ANON) {
-        free_uva_region(vma->va_begin, vma->va_end);
-    } else if (!(vma->flag & VMA_PA)){
+        free_uva_region(vma, pt);
+    } else if (vma->flag & VMA_FILE) {
+        if (free_uva_region(vma, pt)) {
+            vfs_sync_all();
+        }
+    } else if (vma->flag & VMA_PA) {
+        // Nothing to release, the entries are cleared for munmap()
+        free_uva_region(vma, pt);
+    } else {
         // Unexpected
         panic("vma_free flag error");
     }
 
-    kfree(vma);
+    kmem_cache_free(vma_cache, vma);
+}
+
+static void vma_augment(struct rb_node *node)
+{
+    vm_area_t *vma = rb_entry(node, vm_area_t, rb);
+    uint64 max_gap = vma->gap;
+
+    if (node->left) {
+        vm_area_t *left = rb_entry(node->left, vm_area_t, rb);
+
+        if (left->max_gap > max_gap) {
+            max_gap = left->max_gap;
+        }
+    }
+
+    if (node->right) {
+        vm_area_t *right = rb_entry(node->right, vm_area_t, rb);
+
+        if (right->max_gap > max_gap) {
+            max_gap = right->max_gap;
+        }
+    }
+
+    vma->max_gap = max_gap;
+}
+
+/*
+ * Return the lowest vm_area_t which ends above @addr, or NULL.
+ */
+static vm_area_t *vma_find_next(vm_area_meta_t *vma_meta, uint64 addr)
+{
+    struct rb_node *node = vma_meta->rb.node;
+    vm_area_t *ret = NULL;
+
+    while (node) {
+        vm_area_t *vma = rb_entry(node, vm_area_t, rb);
+
+        if (addr < vma->va_end) {
+            ret = vma;
+
+            if (addr >= vma->va_begin) {
+                break;
+            }
+
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+
+    return ret;
 }
 
 static vm_area_t *vma_find(vm_area_meta_t *vma_meta, uint64 addr)
 {
     vm_area_t *vma;
 
-    list_for_each_entry(vma, &vma_meta->vma, list) {
-        if (vma->va_begin <= addr && addr < vma->va_end) {
-            return vma;
-        }
+    vma = vma_find_next(vma_meta, addr);
+
+    if (vma && vma->va_begin <= addr) {
+        return vma;
     }
 
     return NULL;
 }
 
-void mmu_init(void)
+/*
+ * Insert @vma, which doesn't overlap the others, into @vma_meta.
+ */
+static void vma_link(vm_area_meta_t *vma_meta, vm_area_t *vma)
 {
+    struct rb_node **link = &vma_meta->rb.node;
+    struct rb_node *parent = NULL, *prev, *next;
+
+    while (*link) {
+        parent = *link;
+
+        if (vma->va_begin < rb_entry(parent, vm_area_t, rb)->va_begin) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+
+    rb_link_node(&vma->rb, parent, link);
+
+    prev = rb_prev(&vma->rb);
+    next = rb_next(&vma->rb);
+
+    if (prev) {
+        vm_area_t *prev_vma = rb_entry(prev, vm_area_t, rb);
+
+        vma->gap = vma->va_begin - prev_vma->va_end;
+        list_add(&vma->list, &prev_vma->list);
+    } else {
+        vma->gap = vma->va_begin;
+        list_add(&vma->list, &vma_meta->vma);
+    }
+
+    rb_propagate(&vma->rb, vma_augment);
+
+    if (next) {
+        vm_area_t *next_vma = rb_entry(next, vm_area_t, rb);
+
+        next_vma->gap = next_vma->va_begin - vma->va_end;
+        rb_propagate(next, vma_augment);
+    }
+
+    rb_insert_color(&vma->rb, &vma_meta->rb, vma_augment);
+}
+
+/*
+ * Remove @vma from @vma_meta, its gap goes to the next vm_area_t.
+ */
+static void vma_unlink(vm_area_meta_t *vma_meta, vm_area_t *vma)
+{
+    struct rb_node *next;
+    uint64 gap_begin;
+
+    next = rb_next(&vma->rb);
+    gap_begin = vma->va_begin - vma->gap;
+
+    list_del(&vma->list);
+    rb_erase(&vma->rb, &vma_meta->rb, vma_augment);
+
+    if (next) {
+        vm_area_t *next_vma = rb_entry(next, vm_area_t, rb);
+
+        next_vma->gap = next_vma->va_begin - gap_begin;
+        rb_propagate(next, vma_augment);
+    }
+}
+
+static inline vm_area_t *vma_next(vm_area_meta_t *vma_meta, vm_area_t *vma)
+{
+    if (vma->list.next == &vma_meta->vma) {
+        return NULL;
+    }
+
+    return list_entry(vma->list.next, vm_area_t, list);
+}
+
+/*
+ * Split @vma at @addr, inside @vma and page aligned. @vma keeps the lower
+ * part, the upper part is returned. The block of a VMA_KVA @vma is shared
+ * as a whole, such @vma can't be split.
+ */
+static vm_area_t *vma_split(vm_area_meta_t *vma_meta, vm_area_t *vma,
+                            uint64 addr)
+{
+    vm_area_t *new_vma;
+    uint64 off;
+
+    off = addr - vma->va_begin;
+
+    new_vma = kmem_cache_alloc(vma_cache);
+
+    new_vma->va_begin = addr;
+    new_vma->va_end = vma->va_end;
+    new_vma->flag = vma->flag;
+    new_vma->kva = vma->kva ? vma->kva + off : 0;
+    new_vma->vnode = vma->vnode;
+    new_vma->file_offset = vma->file_offset;
+
+    if (vma->flag & VMA_FILE) {
+        new_vma->file_offset += off;
+    }
+
+    vma->va_end = addr;
+
+    vma_link(vma_meta, new_vma);
+
+    return new_vma;
+}
+
+/*
+ * Return 1 if @begin ~ @end is mapped without holes.
+ */
+static int vma_range_mapped(vm_area_meta_t *vma_meta, uint64 begin,
+                            uint64 end)
+{
+    vm_area_t *vma;
+
+    for (vma = vma_find_next(vma_meta, begin); vma && begin < end;
+         vma = vma_next(vma_meta, vma)) {
+        if (vma->va_begin > begin) {
+            return 0;
+        }
+
+        begin = vma->va_end;
+    }
+
+    return begin >= end;
+}
+
+/*
+ * Split the vm_area_t and the block entries crossing @begin or @end, so
+ * that @begin ~ @end consists of whole vm_area_t. Return -1 without
+ * changing anything if a VMA_KVA vm_area_t would be split, or -1 if a
+ * block can't be split for lack of memory.
+ */
+static int vma_split_range(vm_area_meta_t *vma_meta, pd_t *pt, uint64 begin,
+                           uint64 end)
+{
+    vm_area_t *first, *last;
+
+    first = vma_find(vma_meta, begin);
+    last = vma_find(vma_meta, end - 1);
+
+    if ((first && first->va_begin < begin && first->flag & VMA_KVA) ||
+        (last && last->va_end > end && last->flag & VMA_KVA)) {
+        return -1;
+    }
+
+    if (first && first->va_begin < begin) {
+        vma_split(vma_meta, first, begin);
+    }
+
+    // @last may be the upper part of @first now
+    last = vma_find(vma_meta, end - 1);
+
+    if (last && last->va_end > end) {
+        vma_split(vma_meta, last, end);
+    }
+
+    if (pt_split_at(pt, begin) || pt_split_at(pt, end)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Return the lowest address >= @low of a free range of @len bytes below
+ * USER_VA_END, or 0 if there is none. The gaps are searched with
+ * vm_area_t.max_gap instead of visiting every vm_area_t.
+ */
+static uint64 vma_unmapped_area(vm_area_meta_t *vma_meta, uint64 low,
+                                uint64 len)
+{
+    struct rb_node *node;
+    vm_area_t *vma;
+    uint64 gap_begin, gap_end;
+
+    if (len > USER_VA_END || low > USER_VA_END - len) {
+        return 0;
+    }
+
+    node = vma_meta->rb.node;
+
+    if (!node || rb_entry(node, vm_area_t, rb)->max_gap < len) {
+        goto CHECK_HIGHEST;
+    }
+
+    vma = rb_entry(node, vm_area_t, rb);
+
+    while (1) {
+        // Go left first for the lowest gap
+        if (vma->va_begin >= low + len && vma->rb.left &&
+            rb_entry(vma->rb.left, vm_area_t, rb)->max_gap >= len) {
+            vma = rb_entry(vma->rb.left, vm_area_t, rb);
+            continue;
+        }
+
+CHECK_CURRENT:
+        gap_begin = vma->va_begin - vma->gap;
+        gap_end = vma->va_begin;
+
+        if (gap_begin < low) {
+            gap_begin = low;
+        }
+
+        if (gap_end >= gap_begin + len) {
+            return gap_begin;
+        }
+
+        if (vma->rb.right &&
+            rb_entry(vma->rb.right, vm_area_t, rb)->max_gap >= len) {
+            vma = rb_entry(vma->rb.right, vm_area_t, rb);
+            continue;
+        }
+
+        // Go up to the first ancestor whose left subtree has been searched
+        while (1) {
+            struct rb_node *prev = &vma->rb;
+
+            node = prev->parent;
+
+            if (!node) {
+                goto CHECK_HIGHEST;
+            }
+
+            vma = rb_entry(node, vm_area_t, rb);
+
+            if (prev == node->left) {
+                goto CHECK_CURRENT;
+            }
+        }
+    }
+
+CHECK_HIGHEST:
+    node = rb_last(&vma_meta->rb);
+    gap_begin = node ? rb_entry(node, vm_area_t, rb)->va_end : 0;
+
+    if (gap_begin < low) {
+        gap_begin = low;
+    }
+
+    if (USER_VA_END - gap_begin >= len) {
+        return gap_begin;
+    }
+
+    return 0;
+}
+
+/*
+ * Program the translation registers with the boot page tables and turn on
+ * the MMU of the calling core.
+ */
+static void mmu_enable(void)
+{
+    uint64 tcr_el1;
     uint32 sctlr_el1;
 
     // Set Translation Control Register
-    write_sysreg(TCR_EL1, TCR_CONFIG_DEFAULT);
+    tcr_el1 = TCR_CONFIG_DEFAULT;
+
+    // ID_AA64MMFR0_EL1.ASIDBits: 0b0010 means 16 bits
+    if (((read_sysreg(ID_AA64MMFR0_EL1) >> 4) & 0xf) == 0b0010) {
+        tcr_el1 |= TCR_AS;
+    }
+
+    write_sysreg(TCR_EL1, tcr_el1);
 
     // Set Memory Attribute Indirection Register
     write_sysreg(MAIR_EL1,
                 (MAIR_DEVICE_nGnRnE << (MAIR_IDX_DEVICE_nGnRnE * 8)) |
-                (MAIR_NORMAL_NOCACHE << (MAIR_IDX_NORMAL_NOCACHE * 8)));
-    
+                (MAIR_NORMAL_NOCACHE << (MAIR_IDX_NORMAL_NOCACHE * 8)) |
+                (MAIR_NORMAL_WBWA << (MAIR_IDX_NORMAL_WBWA * 8)));
+
+    write_sysreg(TTBR0_EL1, BOOT_PGD);
+    write_sysreg(TTBR1_EL1, BOOT_PGD);
+
+    asm volatile("isb");
+
+    // Enable MMU (and the data and instruction caches)
+    sctlr_el1 = read_sysreg(SCTLR_EL1);
+    write_sysreg(SCTLR_EL1, sctlr_el1 | SCTLR_CONFIG);
+
+    asm volatile("isb");
+}
+
+void mmu_init(void)
+{
     // Set Identity Paging
     // 0x00000000 ~ 0x3f000000: Normal
     // 0x3f000000 ~ 0x40000000: Device
@@ -204,75 +906,309 @@ void mmu_init(void)
     BOOT_PUD[0] = (uint64)BOOT_PMD | PD_TABLE;
     BOOT_PUD[1] = 0x40000000 | PD_MAIR_DEVICE_IDX | PD_BE;
 
+#ifdef CACHE_BENCH
+    // 0x80000000 ~ 0xc0000000: Non-cacheable alias of 0x00000000 ~ 0x40000000
+    BOOT_PUD[2] = 0x00000000 | PD_MAIR_NOCACHE_IDX | PD_SH_INNER | PD_BE;
+#endif
+
     for (int i = 0; i < 504; ++i) {
-        BOOT_PMD[i] = (i * (1 << 21)) | PD_MAIR_NORMAL_IDX | PD_BE;
+        BOOT_PMD[i] = (i * (1 << 21)) | PD_MAIR_NORMAL_IDX | PD_SH_INNER |
+                      PD_BE;
     }
 
     for (int i = 504; i < 512; ++i) {
         BOOT_PMD[i] = (i * (1 << 21)) | PD_MAIR_DEVICE_IDX | PD_BE;
     }
 
-    write_sysreg(TTBR0_EL1, BOOT_PGD);
-    write_sysreg(TTBR1_EL1, BOOT_PGD);
+    mmu_enable();
+}
 
-    // Enable MMU
-    sctlr_el1 = read_sysreg(SCTLR_EL1);
-    write_sysreg(SCTLR_EL1, sctlr_el1 | 1);
+void mmu_init_secondary(void)
+{
+    // The boot page tables have been set up by core 0
+    mmu_enable();
 }
 
-pd_t *pt_create(void)
+#ifdef CACHE_BENCH
+#define CACHE_BENCH_SIZE    (16 * PAGE_SIZE)
+#define CACHE_BENCH_ROUNDS  64
+
+// See BOOT_PUD[2] in mmu_init()
+#define NOCACHE_ALIAS(x)    ((char *)((uint64)(x) + 0x80000000))
+
+static uint64 cache_bench_copy(char *dst, char *src)
 {
-    pd_t *pt = kmalloc(PAGE_TABLE_SIZE);
+    uint64 start;
 
-    for (int i = 0; i < PAGE_TABLE_SIZE / sizeof(pt[0]); ++i) {
-        pt[i] = 0;
+    start = read_sysreg(cntpct_el0);
+
+    for (int i = 0; i < CACHE_BENCH_ROUNDS; ++i) {
+        memncpy(dst, src, CACHE_BENCH_SIZE);
     }
 
-    return pt;
+    return read_sysreg(cntpct_el0) - start + 1;
 }
 
-void pt_free(pd_t *pt)
+void mmu_cache_bench(void)
 {
-    // TODO
+    char *src, *dst;
+    uint64 freq, total, cached, uncached;
+
+    src = kmalloc(CACHE_BENCH_SIZE);
+    dst = kmalloc(CACHE_BENCH_SIZE);
+
+    if (!src || !dst) {
+        uart_sync_printf("[cache] bench: out of memory\r\n");
+        return;
+    }
+
+    memset(src, 0x5a, CACHE_BENCH_SIZE);
+
+    cached = cache_bench_copy(dst, src);
+
+    // Write back dirty lines before accessing the memory via the alias
+    dcache_clean_inval_range(src, CACHE_BENCH_SIZE);
+    dcache_clean_inval_range(dst, CACHE_BENCH_SIZE);
+
+    uncached = cache_bench_copy(NOCACHE_ALIAS(dst), NOCACHE_ALIAS(src));
+
+    // Drop lines that may have been fetched speculatively meanwhile
+    dcache_clean_inval_range(dst, CACHE_BENCH_SIZE);
+
+    freq = read_sysreg(cntfrq_el0);
+    total = (uint64)CACHE_BENCH_SIZE * CACHE_BENCH_ROUNDS;
+
+    uart_sync_printf("[cache] memncpy %d bytes x %d\r\n",
+                     CACHE_BENCH_SIZE, CACHE_BENCH_ROUNDS);
+    uart_sync_printf("[cache] cacheable    : %lld ticks (%lld KB/s)\r\n",
+                     cached, total * freq / cached / 1024);
+    uart_sync_printf("[cache] non-cacheable: %lld ticks (%lld KB/s)\r\n",
+                     uncached, total * freq / uncached / 1024);
+
+    kfree(src);
+    kfree(dst);
 }
+#endif
 
-static void _pt_map(pd_t *pt, void *va, void *pa, uint64 flag)
+int kernel_map_page(uint64 va, uint64 pa)
 {
-    pd_t pd;
-    int idx;
+    pd_t *pte;
 
-    // 47 ~ 39, 38 ~ 30, 29 ~ 21, 20 ~ 12
-    for (int layer = 3; layer > 0; --layer) {    
-        idx = ((uint64)va >> (12 + 9 * layer)) & 0b111111111;
-        pd = pt[idx];
+    pte = pt_walk((pd_t *)PA2VA(BOOT_PGD), va, 3);
 
-        if (!(pd & 1)) {
-            // Invalid entry
-            pd_t *tmp = pt_create();
-            pt[idx] = VA2PA(tmp) | PD_TABLE;
-            pt = tmp;
-            continue;
+    if (!pte) {
+        return -1;
+    }
+
+    // Global, AP 0b00: EL1 read-write
+    *pte = pa | PD_UXN | PD_PXN | PD_MAIR_NORMAL_IDX | PD_SH_INNER | PD_L3BE;
+
+    // Visible to the table walks before the page is used
+    asm volatile(
+        "dsb ishst\n"
+        "isb\n"
+    );
+
+    return 0;
+}
+
+uint64 kernel_unmap_page(uint64 va)
+{
+    pd_t *pte;
+    uint64 pa;
+    int level;
+
+    pte = pt_lookup((pd_t *)PA2VA(BOOT_PGD), va, &level);
+
+    if (!pte || !(*pte & 1) || level != 3) {
+        return 0;
+    }
+
+    pa = PD_ADDR(*pte);
+    *pte = 0;
+
+    return pa;
+}
+
+/* Passes of migrate_user_pages() over the page tables */
+#define MIGRATE_PROTECT 0
+#define MIGRATE_REMAP   1
+
+struct migrate_arg {
+    task_struct *task;
+    void **old;
+    void **new;
+    uint32 *refs;
+    int n;
+    int pass;
+};
+
+static void migrate_leaf(pd_t *pd, uint64 va, int level, void *arg)
+{
+    struct migrate_arg *migrate = arg;
+    int i;
+
+    // The blocks map kernel memory or devices, never a user page
+    if (level != 3) {
+        return;
+    }
+
+    for (i = 0; i < migrate->n; ++i) {
+        if (PD_ADDR(*pd) == VA2PA(migrate->old[i])) {
+            break;
         }
+    }
 
-        // Must be a table entry
-        pt = (pd_t *)PA2VA(pd & ~((uint64)0xfff));
+    if (i == migrate->n) {
+        return;
     }
 
-    idx = ((uint64)va >> 12) & 0b111111111;
-    pd = pt[idx];
+    switch (migrate->pass) {
+    case MIGRATE_PROTECT:
+        migrate->refs[i]++;
+
+        if (*pd & PD_RDONLY) {
+            return;
+        }
+
+        *pd |= PD_RDONLY | PD_MIGRATE;
+        break;
+    case MIGRATE_REMAP:
+        *pd = (*pd & ~PD_ADDR(*pd)) | VA2PA(migrate->new[i]);
+
+        if (*pd & PD_MIGRATE) {
+            *pd &= ~(PD_RDONLY | PD_MIGRATE);
+        }
+
+        break;
+    }
+
+    flush_tlb_page(migrate->task, va);
+}
+
+static void migrate_task(task_struct *task, void *arg)
+{
+    struct migrate_arg *migrate = arg;
+
+    migrate->task = task;
+
+    pt_for_each(task->page_table, 0, USER_VA_END, migrate_leaf, migrate);
+}
+
+int migrate_user_pages(void **old, void **new, int n)
+{
+    struct migrate_arg migrate;
+    uint32 refs[MIGRATE_BATCH];
+    int i;
+
+    migrate.old = old;
+    migrate.new = new;
+    migrate.refs = refs;
+    migrate.n = n;
+
+    for (i = 0; i < n; ++i) {
+        refs[i] = 0;
+    }
+
+    // The kernel lock is dropped on a context switch, the tasks of this
+    // core would write to the pages being copied
+    preempt_disable();
+
+    // There is no reverse mapping, every PTE is found by walking all the
+    // page tables. The PTEs are counted and write-protected at once: the
+    // tasks running on the other cores fault on a write until the copy is
+    // done, and wait for the kernel lock.
+    migrate.pass = MIGRATE_PROTECT;
+    task_for_each(migrate_task, &migrate);
+
+    // Besides the page cache
+    vfs_count_cached_pages(old, refs, n);
+
+    for (i = 0; i < n; ++i) {
+        if (refs[i] != page_ref_count(old[i])) {
+            break;
+        }
+    }
+
+    if (i < n) {
+        // A page also referenced from elsewhere (a page table being torn
+        // down) can't move, remap all of them in place
+        migrate.new = old;
+    } else {
+        for (i = 0; i < n; ++i) {
+            memncpy(new[i], old[i], PAGE_SIZE);
+            icache_sync_range(new[i], PAGE_SIZE);
+        }
+
+        vfs_replace_cached_pages(old, new, n);
+    }
+
+    migrate.pass = MIGRATE_REMAP;
+    task_for_each(migrate_task, &migrate);
+
+    preempt_enable();
+
+    return migrate.new == old ? -1 : 0;
+}
+
+pd_t *pt_create(void)
+{
+    return pt_alloc(&nr_pt_pages);
+}
+
+/*
+ * Free @pt and the tables below it. The pages mapped by the level 3
+ * entries belong to the vm_area_t and are not freed here.
+ */
+static void _pt_free(pd_t *pt, int layer)
+{
+    if (layer > 0) {
+        for (int i = 0; i < PAGE_TABLE_SIZE / sizeof(pt[0]); ++i) {
+            if (pt[i] & 1 && PD_IS_TABLE(pt[i])) {
+                _pt_free((pd_t *)PA2VA(PD_ADDR(pt[i])), layer - 1);
+            }
+        }
+    }
+
+    kfree(pt);
+
+    __atomic_fetch_sub(&nr_pt_pages, 1, __ATOMIC_RELAXED);
+}
+
+void pt_free(pd_t *pt)
+{
+    _pt_free(pt, 3);
+}
+
+void pt_stat_show(void)
+{
+    uart_sync_printf("[pt] page table pages: %d, kernel: %d\r\n",
+                     __atomic_load_n(&nr_pt_pages, __ATOMIC_RELAXED),
+                     __atomic_load_n(&nr_kernel_pt_pages, __ATOMIC_RELAXED));
+}
+
+/*
+ * Map @va -> @pa with a level @level entry. Return 0 if @va is already
+ * mapped.
+ */
+static int _pt_map(pd_t *pt, void *va, void *pa, uint64 flag, int level)
+{
+    pd_t *pte;
+
+    pte = pt_walk(pt, (uint64)va, level);
 
-    if (!(pd & 1)) {
+    if (pte && !(*pte & 1)) {
         // Invalid entry
         // Access permissions
         uint64 ap;
         uint64 uxn;
+        uint64 attr;
 
-        if (flag & PT_R) {
-            if (flag & PT_W) {
-                ap = 0b01;
-            } else {
-                ap = 0b11;
-            }
+        // EL0 can't write without reading, write-only is read-write
+        if (flag & PT_W) {
+            ap = 0b01;
+        } else if (flag & PT_R) {
+            ap = 0b11;
         } else {
             ap = 0b00;
         }
@@ -283,28 +1219,77 @@ static void _pt_map(pd_t *pt, void *va, void *pa, uint64 flag)
             uxn = 1;
         }
 
-        pt[idx] = (uint64)pa | (uxn << 54) | PD_PXN |
-                  PD_MAIR_NORMAL_IDX | (ap << 6) | PD_L3BE;
+        if (flag & PT_NC) {
+            attr = PD_MAIR_NOCACHE_IDX;
+        } else {
+            attr = PD_MAIR_NORMAL_IDX;
+        }
+
+        *pte = (uint64)pa | (uxn << 54) | PD_PXN |
+               attr | PD_SH_INNER | (ap << 6) | PD_NG |
+               (level == 3 ? PD_L3BE : PD_BE);
+
+        return 1;
     }
 
     // TODO: Already mapping, do nothing?
+    return 0;
+}
+
+/*
+ * Return the lowest level (largest) entry that can map @va -> @pa within
+ * @size bytes: a 1GB or 2MB block if both are aligned and the entry is
+ * still unused, a page otherwise.
+ */
+static int pt_map_level(pd_t *pt, uint64 va, uint64 pa, uint64 size)
+{
+    for (int level = 1; level < 3; ++level) {
+        uint64 block = PD_LEVEL_SIZE(level);
+        pd_t *pd;
+
+        if ((va | pa) & (block - 1) || size < block) {
+            continue;
+        }
+
+        pd = pt_walk(pt, va, level);
+
+        if (pd && !(*pd & 1)) {
+            return level;
+        }
+    }
+
+    return 3;
 }
 
-void pt_map(pd_t *pt, void *va, uint64 size, void *pa, uint64 flag)
+uint64 pt_map(pd_t *pt, void *va, uint64 size, void *pa, uint64 flag)
 {
+    uint64 cnt = 0;
+
     if ((uint64)va & (PAGE_SIZE - 1)) {
-        return;
+        return 0;
     }
 
     if ((uint64)pa & (PAGE_SIZE - 1)) {
-        return;
+        return 0;
     }
 
     size = ALIGN(size, PAGE_SIZE);
-    
-    for (uint64 i = 0; i < size; i += PAGE_SIZE) {
-        _pt_map(pt, (void *)((uint64)va + i), (void *)((uint64)pa + i), flag);
+
+    for (uint64 i = 0; i < size; ) {
+        uint64 cur_va = (uint64)va + i;
+        uint64 cur_pa = (uint64)pa + i;
+        int level;
+
+        level = pt_map_level(pt, cur_va, cur_pa, size - i);
+
+        if (_pt_map(pt, (void *)cur_va, (void *)cur_pa, flag, level)) {
+            cnt += PD_LEVEL_SIZE(level) / PAGE_SIZE;
+        }
+
+        i += PD_LEVEL_SIZE(level);
     }
+
+    return cnt;
 }
 
 vm_area_meta_t *vma_meta_create(void)
@@ -313,54 +1298,39 @@ vm_area_meta_t *vma_meta_create(void)
 
     vma_meta = kmalloc(sizeof(vm_area_meta_t));
     INIT_LIST_HEAD(&vma_meta->vma);
+    vma_meta->rb = RB_ROOT;
 
     return vma_meta;
 }
 
 void vma_meta_free(vm_area_meta_t *vma_meta, pd_t *page_table)
 {
-    uint64 old_page_table;
     vm_area_t *vma, *safe;
 
-    old_page_table = get_page_table();
-    set_page_table(page_table);
-
-    preempt_disable();
-
     list_for_each_entry_safe(vma, safe, &vma_meta->vma, list) {
-        vma_free(vma);
+        vma_free(vma, page_table);
     }
 
-    preempt_enable();
-
     kfree(vma_meta);
-
-    set_page_table(old_page_table);
 }
 
-void vma_meta_copy(vm_area_meta_t *to, vm_area_meta_t *from, pd_t *page_table)
+void vma_meta_copy(vm_area_meta_t *to, vm_area_meta_t *from,
+                   pd_t *to_pt, pd_t *from_pt)
 {
-    uint64 old_page_table;
     vm_area_t *vma, *new_vma;
 
-    old_page_table = get_page_table();
-    set_page_table(page_table);
-
-    preempt_disable();
-
     list_for_each_entry(vma, &from->vma, list) {
-        new_vma = vma_clone(vma, (pd_t *)old_page_table);
+        new_vma = vma_clone(vma, to_pt, from_pt);
 
-        list_add_tail(&new_vma->list, &to->vma);
+        vma_link(to, new_vma);
     }
 
-    preempt_enable();
-
-    set_page_table(old_page_table);
+    // The writable entries of @from_pt may be cached in the TLB
+    flush_tlb_mm(current);
 }
 
-void vma_map(vm_area_meta_t *vma_meta, void *va, uint64 size,
-             uint64 flag, void *addr)
+vm_area_t *vma_map(vm_area_meta_t *vma_meta, void *va, uint64 size,
+                   uint64 flag, void *addr)
 {
     vm_area_t *vma;
     int cnt = 0;
@@ -368,28 +1338,69 @@ void vma_map(vm_area_meta_t *vma_meta, void *va, uint64 size,
     if (flag & VMA_PA) cnt++;
     if (flag & VMA_KVA) cnt++;
     if (flag & VMA_ANON) cnt++;
+    if (flag & VMA_FILE) cnt++;
 
     if (cnt != 1) {
-        return;
+        return NULL;
     }
 
     if ((uint64)va & (PAGE_SIZE - 1)) {
-        return;
+        return NULL;
     }
 
-    vma = vma_find(vma_meta, (uint64)va);
-    if (vma) {
-        return;
+    // Overlap with the others
+    vma = vma_find_next(vma_meta, (uint64)va);
+    if (vma && vma->va_begin < (uint64)va + size) {
+        return NULL;
     }
 
-    vma = vma_find(vma_meta, (uint64)va + size - 1);
-    if (vma) {
-        return;
+    vma = vma_create(va, size, flag, addr);
+
+    vma_link(vma_meta, vma);
+
+    return vma;
+}
+
+/*
+ * Handle a write to the present, read-only page @va that is writable in
+ * @vma (copy-on-write). Return -1 if the copy can't be allocated.
+ */
+static int do_wp_page(vm_area_t *vma, pd_t *pte, uint64 va)
+{
+    uint64 kva;
+
+    kva = PA2VA(PD_ADDR(*pte));
+
+    if (is_shared_page(vma, kva)) {
+        void *new_kva;
+
+        new_kva = alloc_page_movable();
+
+        if (!new_kva) {
+            return -1;
+        }
+
+        memncpy(new_kva, (void *)kva, PAGE_SIZE);
+
+        if (vma->flag & VMA_X) {
+            icache_sync_range(new_kva, PAGE_SIZE);
+        }
+
+        page_ref_init(new_kva);
+
+        if (!is_block_page(vma, kva)) {
+            page_ref_dec((void *)kva);
+        }
+
+        *pte = (*pte & ~PD_ADDR(*pte)) | VA2PA(new_kva);
     }
 
-    vma = vma_create(va, size, flag, addr);
+    // The last user of the page just takes it back
+    *pte &= ~PD_RDONLY;
 
-    list_add_tail(&vma->list, &vma_meta->vma);
+    flush_tlb_page(current, va);
+
+    return 0;
 }
 
 static void do_page_fault(esr_el1_t *esr)
@@ -398,6 +1409,8 @@ static void do_page_fault(esr_el1_t *esr)
     uint64 va;
     uint64 fault_perm;
     vm_area_t *vma;
+    pd_t *pte;
+    int level;
 
     far = read_sysreg(FAR_EL1);
 
@@ -426,20 +1439,204 @@ static void do_page_fault(esr_el1_t *esr)
 
     va = far & ~(PAGE_SIZE - 1);
 
-    if (vma->kva) {
-        uint64 offset;
+    current->nr_faults++;
+
+    pte = pt_lookup(current->page_table, va, &level);
+
+    if (pte && *pte & 1) {
+        // Permission fault of a present page: the first write to a clean
+        // shared file page, or copy-on-write
+        if (fault_perm != VMA_W) {
+            goto PAGE_FAULT_INVALID;
+        }
+
+        if ((*pte & (PD_USER | PD_RDONLY)) == PD_USER) {
+            // Write-protected by migrate_user_pages() at the time of the
+            // fault, already writable from EL0 again
+            return;
+        }
+
+        if (!(*pte & PD_RDONLY)) {
+            goto PAGE_FAULT_INVALID;
+        }
+
+        pte = pt_lookup_page(current->page_table, va);
+
+        if (!pte) {
+            goto PAGE_FAULT_INVALID;
+        }
+
+        if (vma->flag & VMA_SHARED) {
+            *pte = (*pte & ~PD_RDONLY) | PD_DIRTY;
+            flush_tlb_page(current, va);
+        } else if (do_wp_page(vma, pte, va)) {
+            goto PAGE_FAULT_INVALID;
+        }
+    } else if (vma->flag & VMA_FILE && !(vma->flag & VMA_SHARED)) {
+        uint64 begin, end;
+        void *kva;
+
+        kva = vfs_getpage(vma->vnode, vma->file_offset + va - vma->va_begin);
+
+        if (!kva) {
+            goto PAGE_FAULT_INVALID;
+        }
+
+        // The page cache is shared by all the private mappings of the file,
+        // the first write copies the page
+        if (!pt_map(current->page_table, (void *)va, PAGE_SIZE,
+                    (void *)VA2PA(kva), vma->flag & ~VMA_W)) {
+            // Out of memory for the tables
+            if (!page_ref_dec(kva)) {
+                free_page(kva);
+            }
+
+            goto PAGE_FAULT_INVALID;
+        }
+
+        if (fault_perm == VMA_W &&
+            do_wp_page(vma, pt_lookup_page(current->page_table, va), va)) {
+            goto PAGE_FAULT_INVALID;
+        }
+
+        // Map the neighbouring cached pages, nothing is read in for them
+        begin = ALIGN_DOWN(va, FAULT_AROUND_PAGES * PAGE_SIZE);
+        end = begin + FAULT_AROUND_PAGES * PAGE_SIZE;
+
+        if (begin < vma->va_begin) {
+            begin = vma->va_begin;
+        }
+
+        if (end > vma->va_end) {
+            end = vma->va_end;
+        }
+
+        for (uint64 addr = begin; addr < end; addr += PAGE_SIZE) {
+            if (addr == va) {
+                continue;
+            }
+
+            kva = vfs_findpage(vma->vnode,
+                               vma->file_offset + addr - vma->va_begin);
+
+            if (!kva) {
+                continue;
+            }
+
+            if (pt_map(current->page_table, (void *)addr, PAGE_SIZE,
+                       (void *)VA2PA(kva), vma->flag & ~VMA_W)) {
+                current->nr_fault_around++;
+            } else {
+                page_ref_dec(kva);
+            }
+        }
+    } else if (vma->flag & VMA_FILE) {
+        uint64 flag = vma->flag;
+        void *kva;
+
+        // All the shared mappings of the file write to the cached page
+        kva = vfs_getpage(vma->vnode, vma->file_offset + va - vma->va_begin);
+
+        if (!kva) {
+            goto PAGE_FAULT_INVALID;
+        }
+
+        // Map a shared page read-only until it is written, so only the
+        // dirty pages are written back
+        if (fault_perm != VMA_W) {
+            flag &= ~VMA_W;
+        }
+
+        if (!pt_map(current->page_table, (void *)va, PAGE_SIZE,
+                    (void *)VA2PA(kva), flag)) {
+            // Out of memory for the tables
+            if (!page_ref_dec(kva)) {
+                free_page(kva);
+            }
+
+            goto PAGE_FAULT_INVALID;
+        }
+
+        if (fault_perm == VMA_W) {
+            *pt_lookup_page(current->page_table, va) |= PD_DIRTY;
+        }
+    } else if (vma->kva) {
+        uint64 begin, end;
+        uint64 mapped;
+        uint64 flag;
+
+        flag = vma->flag;
+
+        // Don't let the writes to a shared block be seen by the others
+        if (vma->flag & VMA_KVA && page_ref_count((void *)vma->kva) > 1) {
+            flag &= ~VMA_W;
+        }
+
+        // Map the largest aligned block around @va within @vma
+        for (level = 1; level < 3; ++level) {
+            begin = ALIGN_DOWN(va, PD_LEVEL_SIZE(level));
+
+            if (begin >= vma->va_begin &&
+                begin + PD_LEVEL_SIZE(level) <= vma->va_end &&
+                pt_map_level(current->page_table, begin,
+                             VA2PA(vma->kva + begin - vma->va_begin),
+                             PD_LEVEL_SIZE(level)) == level) {
+                break;
+            }
+        }
+
+        if (level == 3) {
+            begin = ALIGN_DOWN(va, FAULT_AROUND_PAGES * PAGE_SIZE);
+            end = begin + FAULT_AROUND_PAGES * PAGE_SIZE;
+
+            if (begin < vma->va_begin) {
+                begin = vma->va_begin;
+            }
+
+            if (end > vma->va_end) {
+                end = vma->va_end;
+            }
+        } else {
+            end = begin + PD_LEVEL_SIZE(level);
+        }
+
+        mapped = pt_map(current->page_table, (void *)begin, end - begin,
+                        (void *)VA2PA(vma->kva + begin - vma->va_begin), flag);
+
+        // Out of memory for the tables
+        if (!mapped) {
+            goto PAGE_FAULT_INVALID;
+        }
+
+        if (mapped > 1) {
+            current->nr_fault_around += mapped - 1;
+        }
+
+        if (fault_perm == VMA_W && !(flag & VMA_W)) {
+            pte = pt_lookup_page(current->page_table, va);
 
-        offset = va - vma->va_begin;
-        
-        pt_map(current->page_table, (void *)va, PAGE_SIZE, 
-               (void *)VA2PA(vma->kva + offset), vma->flag);
+            if (!pte || do_wp_page(vma, pte, va)) {
+                goto PAGE_FAULT_INVALID;
+            }
+        }
     } else if (vma->flag & VMA_ANON) {
-        void *kva = kmalloc(PAGE_SIZE);
+        void *kva = zero_page_alloc();
 
-        memzero(kva, PAGE_SIZE);
+        // Out of memory
+        if (!kva) {
+            goto PAGE_FAULT_INVALID;
+        }
+
+        page_ref_init(kva);
 
-        pt_map(current->page_table, (void *)va, PAGE_SIZE, 
-               (void *)VA2PA(kva), vma->flag);
+        if (!pt_map(current->page_table, (void *)va, PAGE_SIZE,
+                    (void *)VA2PA(kva), vma->flag)) {
+            // Out of memory for the tables
+            page_ref_dec(kva);
+            free_page(kva);
+
+            goto PAGE_FAULT_INVALID;
+        }
     } else {
         // Unexpected result
         goto PAGE_FAULT_INVALID;
@@ -471,6 +1668,14 @@ void mem_abort(esr_el1_t *esr)
     case FSC_TF_L3:
 #ifdef DEMANDING_PAGE_DEBUG
         uart_sync_printf("[Translation fault]: 0x%llx\r\n", addr);
+#endif
+        do_page_fault(esr);
+        break;
+    case FSC_PF_L1:
+    case FSC_PF_L2:
+    case FSC_PF_L3:
+#ifdef DEMANDING_PAGE_DEBUG
+        uart_sync_printf("[Permission fault]: 0x%llx\r\n", addr);
 #endif
         do_page_fault(esr);
         break;
@@ -484,35 +1689,22 @@ void mem_abort(esr_el1_t *esr)
 void syscall_mmap(trapframe *frame, void *addr, size_t len, int prot,
                   int flags, int fd, int file_offset)
 {
-    vm_area_t *vma;
     int mapflag;
 
     // do some initial work
     len = ALIGN(len, PAGE_SIZE);
 
     if (addr == NULL) {
-        addr = (void *)0x550000000000;
+        addr = (void *)MMAP_BASE;
     }
 
-    while (1) {
-        if ((uint64)addr > 0x0000ffffffffffff) {
-            frame->x0 = 0;
-            return;
-        }
-
-        vma = vma_find(current->address_space, (uint64)addr);
-        if (vma) {
-            addr = (void *)((uint64)addr + 0x10000000);
-            continue;
-        }
-
-        vma = vma_find(current->address_space, (uint64)addr + len - 1);
-        if (vma) {
-            addr = (void *)((uint64)addr + 0x10000000);
-            continue;
-        }
+    // Use @addr as a hint, take the first free range above it
+    addr = (void *)vma_unmapped_area(current->address_space,
+                                     ALIGN((uint64)addr, PAGE_SIZE), len);
 
-        break;
+    if (!addr || !len) {
+        frame->x0 = 0;
+        return;
     }
 
     mapflag = 0;
@@ -521,21 +1713,64 @@ void syscall_mmap(trapframe *frame, void *addr, size_t len, int prot,
     if (prot & PROT_WRITE) mapflag |= VMA_W;
     if (prot & PROT_EXEC)  mapflag |= VMA_X;
 
-    if (flags & MAP_POPULATE) {
-        void *kva;
-        
-        mapflag |= VMA_KVA;
+    if (!(flags & MAP_ANONYMOUS) && fd >= 0) {
+        struct file *f;
+        vm_area_t *vma;
+
+        if (fd > current->maxfd || !current->fds[fd].vnode ||
+            file_offset < 0 || file_offset & (PAGE_SIZE - 1)) {
+            frame->x0 = 0;
+            return;
+        }
+
+        f = &current->fds[fd];
+
+        if (!f->vnode->v_ops->readpage) {
+            frame->x0 = 0;
+            return;
+        }
 
-        kva = kmalloc(len);
-        memzero(kva, len);
+        mapflag |= VMA_FILE;
 
-        vma_map(current->address_space, addr, len, mapflag, kva);
+        if (flags & MAP_SHARED) {
+            // The writes must be able to reach the file
+            if (mapflag & VMA_W && !f->vnode->v_ops->writepage) {
+                frame->x0 = 0;
+                return;
+            }
+
+            mapflag |= VMA_SHARED;
+        }
+
+        vma = vma_map(current->address_space, addr, len, mapflag, f->vnode);
+
+        if (!vma) {
+            frame->x0 = 0;
+            return;
+        }
 
-        pt_map(current->page_table, addr, len, (void *)VA2PA(kva), mapflag);
-    } else if (flags & MAP_ANONYMOUS) {
+        vma->file_offset = file_offset;
+    } else if (flags & (MAP_ANONYMOUS | MAP_POPULATE)) {
         mapflag |= VMA_ANON;
 
         vma_map(current->address_space, addr, len, mapflag, NULL);
+
+        // Page by page, as the faults would, so each page can be unmapped
+        // or moved on its own
+        for (uint64 off = 0; flags & MAP_POPULATE && off < len;
+             off += PAGE_SIZE) {
+            void *kva = zero_page_alloc();
+
+            if (!kva) {
+                // The rest is faulted in
+                break;
+            }
+
+            page_ref_init(kva);
+
+            pt_map(current->page_table, (char *)addr + off, PAGE_SIZE,
+                   (void *)VA2PA(kva), mapflag);
+        }
     } else {
         // Unexpected.
         frame->x0 = 0;
@@ -543,4 +1778,171 @@ void syscall_mmap(trapframe *frame, void *addr, size_t len, int prot,
     }
 
     frame->x0 = (uint64)addr;
-}
\ No newline at end of file
+}
+
+/*
+ * Return the end of @addr ~ @addr + @len rounded up to pages, or 0 if the
+ * range is empty, not aligned or out of the user address space.
+ */
+static uint64 uva_range_end(void *addr, size_t len)
+{
+    uint64 begin = (uint64)addr;
+
+    if (begin & (PAGE_SIZE - 1) || !len || len > USER_VA_END ||
+        begin > USER_VA_END - ALIGN(len, PAGE_SIZE)) {
+        return 0;
+    }
+
+    return begin + ALIGN(len, PAGE_SIZE);
+}
+
+void syscall_munmap(trapframe *frame, void *addr, size_t len)
+{
+    vm_area_meta_t *vma_meta = current->address_space;
+    pd_t *pt = current->page_table;
+    vm_area_t *vma, *next;
+    uint64 begin, end;
+
+    begin = (uint64)addr;
+    end = uva_range_end(addr, len);
+
+    if (!end || vma_split_range(vma_meta, pt, begin, end)) {
+        frame->x0 = -1;
+        return;
+    }
+
+    for (vma = vma_find_next(vma_meta, begin); vma && vma->va_begin < end;
+         vma = next) {
+        uint64 vma_begin = vma->va_begin;
+        uint64 vma_end = vma->va_end;
+
+        next = vma_next(vma_meta, vma);
+
+        vma_unlink(vma_meta, vma);
+        vma_free(vma, pt);
+
+        flush_tlb_range(current, vma_begin, vma_end);
+    }
+
+    frame->x0 = 0;
+}
+
+static void protect_leaf(pd_t *pd, uint64 va, int level, void *arg)
+{
+    vm_area_t *vma = arg;
+
+    if (vma->flag & (VMA_R | VMA_W)) {
+        *pd |= PD_USER;
+    } else {
+        *pd &= ~PD_USER;
+    }
+
+    // A page made writable stays read-only until written: it may still be
+    // shared (copy-on-write) or clean (VMA_SHARED), see do_page_fault().
+    // VMA_PA pages are neither.
+    if (!(vma->flag & VMA_W)) {
+        *pd |= PD_RDONLY;
+    } else if (vma->flag & VMA_PA) {
+        *pd &= ~PD_RDONLY;
+    }
+
+    if (vma->flag & VMA_X) {
+        *pd &= ~PD_UXN;
+    } else {
+        *pd |= PD_UXN;
+    }
+}
+
+void syscall_mprotect(trapframe *frame, void *addr, size_t len, int prot)
+{
+    vm_area_meta_t *vma_meta = current->address_space;
+    pd_t *pt = current->page_table;
+    vm_area_t *vma;
+    uint64 begin, end;
+    uint64 flag;
+
+    begin = (uint64)addr;
+    end = uva_range_end(addr, len);
+
+    if (!end || !vma_range_mapped(vma_meta, begin, end)) {
+        frame->x0 = -1;
+        return;
+    }
+
+    flag = 0;
+
+    if (prot & PROT_READ)  flag |= VMA_R;
+    if (prot & PROT_WRITE) flag |= VMA_W;
+    if (prot & PROT_EXEC)  flag |= VMA_X;
+
+    for (vma = vma_find_next(vma_meta, begin); vma && vma->va_begin < end;
+         vma = vma_next(vma_meta, vma)) {
+        // The writes must be able to reach the file, see syscall_mmap()
+        if (vma->flag & VMA_SHARED && flag & VMA_W &&
+            !vma->vnode->v_ops->writepage) {
+            frame->x0 = -1;
+            return;
+        }
+    }
+
+    if (vma_split_range(vma_meta, pt, begin, end)) {
+        frame->x0 = -1;
+        return;
+    }
+
+    for (vma = vma_find_next(vma_meta, begin); vma && vma->va_begin < end;
+         vma = vma_next(vma_meta, vma)) {
+        vma->flag = (vma->flag & ~(VMA_R | VMA_W | VMA_X)) | flag;
+
+        pt_for_each(pt, vma->va_begin, vma->va_end, protect_leaf, vma);
+    }
+
+    flush_tlb_range(current, begin, end);
+
+    frame->x0 = 0;
+}
+
+void syscall_madvise(trapframe *frame, void *addr, size_t len, int advice)
+{
+    vm_area_meta_t *vma_meta = current->address_space;
+    pd_t *pt = current->page_table;
+    vm_area_t *vma;
+    uint64 begin, end;
+    int written;
+
+    begin = (uint64)addr;
+    end = uva_range_end(addr, len);
+
+    if (advice != MADV_DONTNEED || !end ||
+        !vma_range_mapped(vma_meta, begin, end)) {
+        frame->x0 = -1;
+        return;
+    }
+
+    // Only the pages faulted in one by one can be dropped
+    for (vma = vma_find_next(vma_meta, begin); vma && vma->va_begin < end;
+         vma = vma_next(vma_meta, vma)) {
+        if (!(vma->flag & (VMA_ANON | VMA_FILE))) {
+            frame->x0 = -1;
+            return;
+        }
+    }
+
+    written = 0;
+
+    for (vma = vma_find_next(vma_meta, begin); vma && vma->va_begin < end;
+         vma = vma_next(vma_meta, vma)) {
+        uint64 b = vma->va_begin < begin ? begin : vma->va_begin;
+        uint64 e = vma->va_end > end ? end : vma->va_end;
+
+        written += free_uva_range(vma, pt, b, e);
+    }
+
+    flush_tlb_range(current, begin, end);
+
+    if (written) {
+        vfs_sync_all();
+    }
+
+    frame->x0 = 0;
+}
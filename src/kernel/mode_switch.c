@@ -1,12 +1,19 @@
 #include <mode_switch.h>
 #include <signal.h>
 #include <utils.h>
+#include <smp.h>
 
 void exit_to_user_mode(trapframe regs)
 {
     enable_interrupt();
 
-    handle_signal(&regs);
+    if (signal_pending()) {
+        lock_kernel();
+
+        handle_signal(&regs);
+
+        unlock_kernel();
+    }
 
     disable_interrupt();
 }
\ No newline at end of file
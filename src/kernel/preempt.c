@@ -2,24 +2,20 @@
 #include <task.h>
 #include <current.h>
 
+/*
+ * No need to disable interrupts: @preempt belongs to current, and an
+ * interrupt (or a task switched to by it) always leaves it as it was.
+ */
 void preempt_disable(void)
 {
-    uint32 daif;
-
-    daif = save_and_disable_interrupt();
-
     current->preempt += 1;
 
-    restore_interrupt(daif);
+    asm volatile("" ::: "memory");
 }
 
 void preempt_enable(void)
 {
-    uint32 daif;
-
-    daif = save_and_disable_interrupt();
+    asm volatile("" ::: "memory");
 
     current->preempt -= 1;
-
-    restore_interrupt(daif);
 }
\ No newline at end of file
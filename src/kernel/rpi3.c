@@ -5,6 +5,7 @@
 #include <rpi3.h>
 #include <BCM2837.h>
 #include <utils.h>
+#include <cache.h>
 
 /* Mailbox registers */
 #define MAILBOX_BASE    PA2VA(PERIPHERALS_BASE + 0xb880)
@@ -32,6 +33,9 @@ void mailbox_call(unsigned char channel, unsigned int *mb)
     // the channel (in the lower four bits) to the write register.
     unsigned int r = (((unsigned long)mb) & ~0xf) | channel;
 
+    // The VideoCore reads the buffer from memory, not from our data cache
+    dcache_clean_inval_range(mb, mb[0]);
+
     // Check if Mailbox 0 status register’s full flag is set.
     while ((get32(MAILBOX_STATUS) & MAILBOX_FULL)) {};
 
@@ -44,8 +48,11 @@ void mailbox_call(unsigned char channel, unsigned int *mb)
 
         // If not, then you can read from Mailbox 0 Read/Write register.
         // Check if the value is the same as you wrote in step 1.
-        if (r == get32(MAILBOX_READ))
+        if (r == get32(MAILBOX_READ)) {
+            // Discard stale lines so that the response is read from memory
+            dcache_clean_inval_range(mb, mb[0]);
             return;
+        }
     }
 }
 
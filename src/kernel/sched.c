@@ -4,13 +4,24 @@
 #include <current.h>
 #include <list.h>
 #include <preempt.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <asid.h>
 
 #define SCHEDULER_TIMER_HZ 32
 #define SCHEDULER_WATERMARK 1
 
-static struct list_head run_queue;
+struct run_queue {
+    spinlock_t lock;
+    /* @list links the runnable tasks except @idle */
+    struct list_head list;
+    uint32 nr_running;
+    task_struct *idle;
+};
 
-static uint32 schedule_ticks;
+static struct run_queue run_queues[NR_CPUS];
+
+static uint32 schedule_ticks[NR_CPUS];
 
 static void timer_schdule_tick(void *_)
 {
@@ -21,58 +32,141 @@ static void timer_schdule_tick(void *_)
 
 void scheduler_init(void)
 {
-    INIT_LIST_HEAD(&run_queue);
+    for (int cpu = 0; cpu < NR_CPUS; ++cpu) {
+        spin_lock_init(&run_queues[cpu].lock, "rq");
+        INIT_LIST_HEAD(&run_queues[cpu].list);
+        run_queues[cpu].nr_running = 0;
+        run_queues[cpu].idle = NULL;
+    }
 
     timer_add_proc_freq(timer_schdule_tick, NULL, SCHEDULER_TIMER_HZ);
 }
 
+void scheduler_init_secondary(void)
+{
+    // Core 1 ~ 3 don't run timer_proc, just take a tick from the core timer
+    timer_init_core_tick(schedule_tick, SCHEDULER_TIMER_HZ);
+}
+
 void schedule(void)
 {
     uint64 daif;
-    task_struct *task;
+    task_struct *prev, *next;
+    struct run_queue *rq;
 
     daif = save_and_disable_interrupt();
 
-    task = list_first_entry(&run_queue, task_struct, list);
+    prev = current;
+    rq = &run_queues[smp_processor_id()];
 
-    list_del(&task->list);
-    list_add_tail(&task->list, &run_queue);
+    spin_lock(&rq->lock);
 
-    current->need_resched = 0;
+    if (list_empty(&rq->list)) {
+        next = rq->idle;
+    } else {
+        next = list_first_entry(&rq->list, task_struct, list);
 
-    restore_interrupt(daif);
+        list_del(&next->list);
+        list_add_tail(&next->list, &rq->list);
+    }
+
+    spin_unlock(&rq->lock);
+
+    prev->need_resched = 0;
 
-    // Set registers. Set current to task
-    switch_to(current, task);
+    if (next != prev) {
+        next->on_cpu = 1;
+
+        release_kernel_lock(prev);
+
+        // Page table 0 of next, see switch_mm()
+        switch_mm(prev, next);
+
+        // Set registers. Set current to next
+        switch_to(prev, next);
+
+        reacquire_kernel_lock(current);
+    } else {
+        // Let other cores waiting for the kernel lock get in
+        release_kernel_lock(prev);
+        reacquire_kernel_lock(prev);
+    }
+
+    restore_interrupt(daif);
 }
 
 void schedule_tick(void)
 {
-    schedule_ticks += 1;
+    int cpu = smp_processor_id();
 
-    if (schedule_ticks >= SCHEDULER_WATERMARK) {
-        schedule_ticks = 0;
+    schedule_ticks[cpu] += 1;
+
+    if (schedule_ticks[cpu] >= SCHEDULER_WATERMARK) {
+        schedule_ticks[cpu] = 0;
 
         current->need_resched = 1;
     }
 }
 
-void sched_add_task(task_struct *task)
+void sched_add_task_on(task_struct *task, int cpu)
 {
-    preempt_disable();
+    struct run_queue *rq;
+    uint32 daif;
+
+    rq = &run_queues[cpu];
+
+    daif = spin_lock_irqsave(&rq->lock);
 
     task->status = TASK_RUNNING;
+    task->cpu = cpu;
+
+    list_add_tail(&task->list, &rq->list);
+    rq->nr_running += 1;
 
-    list_add_tail(&task->list, &run_queue);
+    spin_unlock_irqrestore(&rq->lock, daif);
 
-    preempt_enable();
+    // Wake up the idle core, see secondary_idle()
+    asm volatile("sev");
+}
+
+void sched_add_task(task_struct *task)
+{
+    int target = 0;
+
+    // Racy read of nr_running is fine, it is only a hint
+    for (int cpu = 1; cpu < NR_CPUS; ++cpu) {
+        if (!cpu_online(cpu)) {
+            continue;
+        }
+
+        if (run_queues[cpu].nr_running < run_queues[target].nr_running) {
+            target = cpu;
+        }
+    }
+
+    sched_add_task_on(task, target);
 }
 
 void sched_del_task(task_struct *task)
 {
-    preempt_disable();
+    struct run_queue *rq;
+    uint32 daif;
+
+    rq = &run_queues[task->cpu];
+
+    daif = spin_lock_irqsave(&rq->lock);
 
     list_del(&task->list);
+    rq->nr_running -= 1;
+
+    spin_unlock_irqrestore(&rq->lock, daif);
+}
 
-    preempt_enable();
-}
\ No newline at end of file
+void sched_set_idle(task_struct *task, int cpu)
+{
+    task->status = TASK_RUNNING;
+    task->cpu = cpu;
+    task->on_cpu = 1;
+
+    run_queues[cpu].idle = task;
+}
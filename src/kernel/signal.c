@@ -7,6 +7,8 @@
 #include <text_user_shared.h>
 #include <syscall.h>
 
+static struct kmem_cache *signal_cache;
+
 // TODO: implement SIGSTOP & SIGCONT kernel handler
 
 /* Kernel defined sighandler_t */
@@ -52,11 +54,17 @@ static struct signal_t *signal_try_get(void)
     return list_first_entry(&current->signal->list, struct signal_t, list);
 }
 
+void signal_init(void)
+{
+    signal_cache = kmem_cache_create("signal_t", sizeof(struct signal_t), 8,
+                                     NULL);
+}
+
 static void signal_add(uint32 signum, struct signal_head_t *head)
 {
     struct signal_t *signal;
 
-    signal = kmalloc(sizeof(struct signal_t));
+    signal = kmem_cache_alloc(signal_cache);
 
     signal->signum = signum;
 
@@ -66,7 +74,7 @@ static void signal_add(uint32 signum, struct signal_head_t *head)
 static void signal_del(struct signal_t *signal)
 {
     list_del(&signal->list);
-    kfree(signal);
+    kmem_cache_free(signal_cache, signal);
 }
 
 static void save_context(void *user_sp, trapframe *frame)
@@ -105,6 +113,11 @@ void signal_head_reset(struct signal_head_t *head)
     }
 }
 
+int signal_pending(void)
+{
+    return !list_empty(&current->signal->list);
+}
+
 void handle_signal(trapframe *frame)
 {
     struct signal_t *signal;
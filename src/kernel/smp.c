@@ -0,0 +1,159 @@
+#include <smp.h>
+#include <task.h>
+#include <sched.h>
+#include <current.h>
+#include <preempt.h>
+#include <spinlock.h>
+#include <cache.h>
+#include <mini_uart.h>
+#include <mm/mm.h>
+
+/*
+ * The firmware parks core 1 ~ 3 in a loop polling these release addresses
+ * (0xd8 + 8 * cpu); writing an entry point there and sending an event
+ * makes the core jump to it at EL2 with the MMU off.
+ */
+#define SPIN_TABLE_BASE     0xd8
+#define SPIN_TABLE(cpu)     ((uint64 *)PA2VA(SPIN_TABLE_BASE + (cpu) * 8))
+
+/* Give up on a core which doesn't come up within 1 second */
+#define SMP_BOOT_TIMEOUT_SEC 1
+
+/* From head.S */
+void _secondary_start(void);
+
+/*
+ * Physical address of the stack used by the core being booted. It is read
+ * by _secondary_start before the MMU is enabled.
+ */
+uint64 secondary_boot_sp;
+
+uint32 cpu_online_mask = 1;
+
+static task_struct *idle_tasks[NR_CPUS];
+
+static spinlock_t kernel_lock = SPINLOCK_INIT("kernel");
+
+void lock_kernel(void)
+{
+    preempt_disable();
+
+    if (!current->lock_depth) {
+        spin_lock(&kernel_lock);
+    }
+
+    current->lock_depth += 1;
+
+    preempt_enable();
+}
+
+void unlock_kernel(void)
+{
+    preempt_disable();
+
+    current->lock_depth -= 1;
+
+    if (!current->lock_depth) {
+        spin_unlock(&kernel_lock);
+    }
+
+    preempt_enable();
+}
+
+/*
+ * Interrupts must be disabled before calling these functions.
+ */
+void release_kernel_lock(task_struct *task)
+{
+    if (task->lock_depth) {
+        spin_unlock(&kernel_lock);
+    }
+}
+
+void reacquire_kernel_lock(task_struct *task)
+{
+    if (task->lock_depth) {
+        spin_lock(&kernel_lock);
+    }
+}
+
+static void secondary_idle(void)
+{
+    while (1) {
+        schedule();
+
+        // Sleep until an interrupt or sched_add_task_on() wakes us up
+        asm volatile("wfe");
+    }
+}
+
+void secondary_start_kernel(int cpu)
+{
+    task_struct *idle;
+
+    idle = idle_tasks[cpu];
+
+    // Must set current first
+    set_current(idle);
+
+    sched_set_idle(idle, cpu);
+    scheduler_init_secondary();
+
+    __atomic_or_fetch(&cpu_online_mask, 1 << cpu, __ATOMIC_RELEASE);
+
+    enable_interrupt();
+
+    secondary_idle();
+
+    // Never reach
+}
+
+static int boot_secondary(int cpu)
+{
+    task_struct *idle;
+    uint64 cntfrq_el0, timeout;
+
+    idle = task_create();
+    // Not vmalloc(): the core uses the stack before its MMU is on
+    idle->kernel_stack = kmalloc(STACK_SIZE);
+    idle_tasks[cpu] = idle;
+
+    // The core runs with the MMU (and data cache) off until mmu_enable()
+    secondary_boot_sp = VA2PA((char *)idle->kernel_stack + STACK_SIZE - 0x10);
+    dcache_clean_range(&secondary_boot_sp, sizeof(secondary_boot_sp));
+
+    *SPIN_TABLE(cpu) = VA2PA(_secondary_start);
+    dcache_clean_range(SPIN_TABLE(cpu), sizeof(uint64));
+
+    asm volatile("sev");
+
+    cntfrq_el0 = read_sysreg(cntfrq_el0);
+    timeout = read_sysreg(cntpct_el0) + cntfrq_el0 * SMP_BOOT_TIMEOUT_SEC;
+
+    while (!(__atomic_load_n(&cpu_online_mask, __ATOMIC_ACQUIRE) &
+             (1 << cpu))) {
+        if (read_sysreg(cntpct_el0) > timeout) {
+            // Leak @idle on purpose, the core may still show up later
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void smp_init(void)
+{
+#ifdef MMU_NOCACHE
+    // See spinlock.h, exclusives don't work on non-cacheable memory
+    uart_sync_printf("[*] MMU_NOCACHE: running on core 0 only\r\n");
+#else
+    for (int cpu = 1; cpu < NR_CPUS; ++cpu) {
+        if (boot_secondary(cpu)) {
+            uart_sync_printf("[!] Failed to bring up core %d\r\n", cpu);
+            continue;
+        }
+
+        uart_sync_printf("[*] Core %d online\r\n", cpu);
+    }
+#endif
+}
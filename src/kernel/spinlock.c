@@ -0,0 +1,78 @@
+#include <spinlock.h>
+
+#ifdef LOCK_STAT
+#include <mini_uart.h>
+
+#define LOCK_STAT_MAX 64
+
+/* Locks register themselves here the first time they are taken */
+static struct lock_stat *lock_stats[LOCK_STAT_MAX];
+static uint32 lock_stats_cnt;
+
+/*
+ * Called with the lock held.
+ */
+void lock_stat_acquired(struct lock_stat *stat, uint32 spins)
+{
+    if (!stat->registered) {
+        uint32 idx;
+
+        idx = __atomic_fetch_add(&lock_stats_cnt, 1, __ATOMIC_RELAXED);
+
+        if (idx < LOCK_STAT_MAX) {
+            lock_stats[idx] = stat;
+        }
+
+        stat->registered = 1;
+    }
+
+    stat->acquired += 1;
+
+    if (spins) {
+        stat->contended += 1;
+        stat->spins += spins;
+    }
+
+    stat->hold_start = read_sysreg(cntpct_el0);
+}
+
+/*
+ * Called with the lock held.
+ */
+void lock_stat_released(struct lock_stat *stat)
+{
+    uint64 hold;
+
+    hold = read_sysreg(cntpct_el0) - stat->hold_start;
+
+    if (hold > stat->max_hold) {
+        stat->max_hold = hold;
+    }
+}
+
+void lock_stat_show(void)
+{
+    uint32 cnt;
+
+    cnt = __atomic_load_n(&lock_stats_cnt, __ATOMIC_RELAXED);
+
+    if (cnt > LOCK_STAT_MAX) {
+        cnt = LOCK_STAT_MAX;
+    }
+
+    uart_sync_printf("[lockstat] name: acquired contended spins max_hold\r\n");
+
+    for (int i = 0; i < cnt; ++i) {
+        struct lock_stat *stat = lock_stats[i];
+
+        if (!stat) {
+            continue;
+        }
+
+        uart_sync_printf("[lockstat] %s: %lld %lld %lld %lld\r\n",
+                         stat->name ? stat->name : "?",
+                         stat->acquired, stat->contended,
+                         stat->spins, stat->max_hold);
+    }
+}
+#endif
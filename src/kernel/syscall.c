@@ -14,6 +14,7 @@
 #include <mm/mm.h>
 #include <mmu.h>
 #include <fs/vfs.h>
+#include <smp.h>
 
 #define KSTACK_VARIABLE(x)                      \
     (void *)((uint64)x -                        \
@@ -56,6 +57,9 @@ syscall_funcp syscall_table[] = {
     (syscall_funcp) syscall_sync,       // 20
     (syscall_funcp) syscall_sigreturn,
     (syscall_funcp) syscall_show_info,
+    (syscall_funcp) syscall_munmap,
+    (syscall_funcp) syscall_mprotect,   // 24
+    (syscall_funcp) syscall_madvise,
 };
 
 void syscall_handler(trapframe *regs)
@@ -100,7 +104,7 @@ void syscall_uart_write(trapframe *_, const char buf[], size_t size)
 // TODO: Passing argv
 void syscall_exec(trapframe *_, const char *name, char *const argv[])
 {
-    void *data;
+    struct vnode *vnode;
     char *kernel_sp;
     int datalen, adj_datalen;
     struct file f;
@@ -112,26 +116,16 @@ void syscall_exec(trapframe *_, const char *name, char *const argv[])
         return;
     }
 
-    datalen = f.vnode->v_ops->getsize(f.vnode);
+    vnode = f.vnode;
+    datalen = vnode->v_ops->getsize(vnode);
 
-    if (datalen < 0) {
-        return;
-    }
-
-    adj_datalen = ALIGN(datalen, PAGE_SIZE);
-
-    data = kmalloc(adj_datalen);
-
-    memzero(data, adj_datalen);
-
-    ret = vfs_read(&f, data, datalen);
+    vfs_close(&f);
 
-    if (ret < 0) {
-        kfree(data);
+    if (datalen < 0 || !vnode->v_ops->readpage) {
         return;
     }
 
-    vfs_close(&f);
+    adj_datalen = ALIGN(datalen, PAGE_SIZE);
 
     // Use origin kernel stack
 
@@ -149,10 +143,12 @@ void syscall_exec(trapframe *_, const char *name, char *const argv[])
     task_init_map(current);
 
     // 0x000000000000 ~ <datalen>: rwx: Code
+    // The image is read from @vnode page by page on the first access
     vma_map(current->address_space, (void *)0, adj_datalen,
-           VMA_R | VMA_W | VMA_X | VMA_KVA, data);
+           VMA_R | VMA_W | VMA_X | VMA_FILE, vnode);
 
-    set_page_table(current->page_table);
+    // Return to EL0 directly instead of via el0_sync_handler
+    unlock_kernel();
 
     exec_user_prog((void *)0, (char *)0xffffffffeff0, kernel_sp);
 }
@@ -178,14 +174,13 @@ void syscall_fork(trapframe *frame)
 
     child = task_create();
 
-    child->kernel_stack = kmalloc(STACK_SIZE);
+    child->kernel_stack = vmalloc(STACK_SIZE);
     memncpy(child->kernel_stack, current->kernel_stack, STACK_SIZE);
 
-    // TODO: Implement copy on write
-
-    // Copy address_space
+    // Share address_space, copy on write
     vma_meta_copy(child->address_space,
                   current->address_space,
+                  child->page_table,
                   current->page_table);
 
     // Copy signal handler
@@ -216,7 +211,10 @@ void syscall_fork(trapframe *frame)
 
 SYSCALL_FORK_END:
 
-    asm volatile("nop");
+    // The child starts here without holding the kernel lock
+    if (!current->lock_depth) {
+        lock_kernel();
+    }
 }
 
 void syscall_exit(trapframe *_)
@@ -269,7 +267,10 @@ void syscall_kill_pid(trapframe *_, int pid)
         goto SYSCALL_KILL_PID_END;
     }
 
-    list_del(&task->list);
+    // @task may be running on another core, see el0_sync_handler()
+    task->status = TASK_DEAD;
+
+    sched_del_task(task);
     kthread_add_wait_queue(task);
 
 SYSCALL_KILL_PID_END:
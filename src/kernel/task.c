@@ -3,10 +3,19 @@
 #include <mm/mm.h>
 #include <text_user_shared.h>
 #include <utils.h>
+#include <spinlock.h>
+#include <current.h>
+#include <asid.h>
+#include <mini_uart.h>
 
 // TODO: Use rbtree to manage tasks
 static struct list_head task_queue;
 
+static struct kmem_cache *task_cache;
+
+/* Protects @task_queue and @max_tid */
+static rwlock_t task_queue_lock = RWLOCK_INIT;
+
 // TODO: recycle usable tid
 uint32 max_tid;
 
@@ -23,6 +32,9 @@ static uint32 alloc_tid(void)
 void task_init(void)
 {
     INIT_LIST_HEAD(&task_queue);
+
+    task_cache = kmem_cache_create("task_struct", sizeof(task_struct), 16,
+                                   NULL);
 }
 
 task_struct *task_create(void)
@@ -32,8 +44,9 @@ task_struct *task_create(void)
     struct sighand_t *sighand;
     pd_t *page_table;
     vm_area_meta_t *as;
+    uint32 daif;
     
-    task = kmalloc(sizeof(task_struct));
+    task = kmem_cache_alloc(task_cache);
     signal = signal_head_create();
     sighand = sighand_create();
     page_table = pt_create();
@@ -42,12 +55,17 @@ task_struct *task_create(void)
     task->address_space = as;
     task->kernel_stack = NULL;
     task->page_table = page_table;
+    task->context_id = 0;
     INIT_LIST_HEAD(&task->list);
-    list_add_tail(&task->task_list, &task_queue);
+
     task->status = TASK_NEW;
     task->need_resched = 0;
-    task->tid = alloc_tid();
     task->preempt = 0;
+    task->cpu = 0;
+    task->on_cpu = 0;
+    task->lock_depth = 0;
+    task->nr_faults = 0;
+    task->nr_fault_around = 0;
 
     task->signal = signal;
     task->sighand = sighand;
@@ -60,15 +78,28 @@ task_struct *task_create(void)
 
     task->maxfd = 2;
 
+    // Publish the task only after it is fully initialized
+    daif = write_lock_irqsave(&task_queue_lock);
+    task->tid = alloc_tid();
+    list_add_tail(&task->task_list, &task_queue);
+    write_unlock_irqrestore(&task_queue_lock, daif);
+
     return task;
 }
 
 void task_free(task_struct *task)
 {
-    if (task->kernel_stack)
+    uint32 daif;
+
+    // The idle tasks of core 1 ~ 3 use kmalloc()ed stacks, see smp.c
+    if (is_vmalloc_addr(task->kernel_stack))
+        vfree(task->kernel_stack);
+    else if (task->kernel_stack)
         kfree(task->kernel_stack);
 
+    daif = write_lock_irqsave(&task_queue_lock);
     list_del(&task->task_list);
+    write_unlock_irqrestore(&task_queue_lock, daif);
 
     signal_head_free(task->signal);
     sighand_free(task->sighand);
@@ -84,27 +115,54 @@ void task_free(task_struct *task)
         }
     }
 
-    kfree(task);
+    kmem_cache_free(task_cache, task);
 }
 
 task_struct *task_get_by_tid(uint32 tid)
 {
-    task_struct *task;
+    task_struct *task, *ret;
+    uint32 daif;
+
+    ret = NULL;
+
+    daif = read_lock_irqsave(&task_queue_lock);
 
     list_for_each_entry(task, &task_queue, task_list) {
         if (task->tid == tid) {
-            return task;
+            ret = task;
+            break;
         }
     }
 
-    return NULL;
+    read_unlock_irqrestore(&task_queue_lock, daif);
+
+    return ret;
+}
+
+void task_for_each(void (*f)(task_struct *task, void *arg), void *arg)
+{
+    struct list_head *pos;
+    uint32 daif;
+
+    daif = read_lock_irqsave(&task_queue_lock);
+
+    for (pos = task_queue.next; pos != &task_queue; pos = pos->next) {
+        read_unlock_irqrestore(&task_queue_lock, daif);
+
+        // Stays in the list, task_free() needs the kernel lock
+        f(list_entry(pos, task_struct, task_list), arg);
+
+        daif = read_lock_irqsave(&task_queue_lock);
+    }
+
+    read_unlock_irqrestore(&task_queue_lock, daif);
 }
 
 void task_init_map(task_struct *task)
 {
     // TODO: map the return addres of mailbox_call
     vma_map(task->address_space, (void *)0x3c000000, 0x03000000,
-           VMA_R | VMA_W | VMA_PA, (void *)0x3c000000);
+           VMA_R | VMA_W | VMA_PA | VMA_NC, (void *)0x3c000000);
 
     vma_map(task->address_space, (void *)0x7f0000000000, TEXT_USER_SHARED_LEN,
            VMA_R | VMA_X | VMA_PA, (void *)VA2PA(TEXT_USER_SHARED_BASE));
@@ -115,9 +173,40 @@ void task_init_map(task_struct *task)
 
 void task_reset_mm(task_struct *task)
 {
-    vma_meta_free(task->address_space, task->page_table);
-    pt_free(task->page_table);
-    
+    vm_area_meta_t *address_space;
+    pd_t *page_table;
+
+    address_space = task->address_space;
+    page_table = task->page_table;
+
     task->page_table = pt_create();
     task->address_space = vma_meta_create();
-}
\ No newline at end of file
+
+    if (task == current) {
+        // Leave the old page table before tearing it down, and drop its
+        // TLB entries at once by the ASID
+        switch_mm(task, task);
+        flush_tlb_mm(task);
+    } else {
+        // Get a clean ASID on the next switch_mm()
+        task->context_id = 0;
+    }
+
+    vma_meta_free(address_space, page_table);
+    pt_free(page_table);
+}
+
+void task_fault_stat_show(void)
+{
+    task_struct *task;
+    uint32 daif;
+
+    daif = read_lock_irqsave(&task_queue_lock);
+
+    list_for_each_entry(task, &task_queue, task_list) {
+        uart_sync_printf("[fault] tid %d: faults %d, fault-around %d\r\n",
+                         task->tid, task->nr_faults, task->nr_fault_around);
+    }
+
+    read_unlock_irqrestore(&task_queue_lock, daif);
+}
@@ -4,10 +4,15 @@
 #include <list.h>
 #include <bitops.h>
 #include <irq.h>
+#include <smp.h>
+#include <spinlock.h>
 
 #define CORE0_TIMER_IRQ_CTRL 0x40000040
 #define CORE0_IRQ_SOURCE 0x40000060
 
+#define CORE_TIMER_IRQ_CTRL(cpu) (CORE0_TIMER_IRQ_CTRL + 4 * (cpu))
+#define CORE_IRQ_SOURCE(cpu)     (CORE0_IRQ_SOURCE + 4 * (cpu))
+
 #define TIMER_PROC_NUM 32
 
 static void timer_irq_handler(void *);
@@ -45,9 +50,21 @@ uint32 t_status;
  */
 uint32 t_interval;
 
+/*
+ * Protects @t_procs, @t_meta, @t_status and @t_interval.
+ *
+ * The timer_proc list is driven by the cntp timer of core 0, so @t_interval
+ * is only meaningful on core 0.
+ */
+static spinlock_t timer_lock = SPINLOCK_INIT("timer");
+
 int timer_show_enable;
 uint64 timer_boot_cnt;
 
+/* Periodic tick of core 1 ~ 3, see timer_init_core_tick() */
+static void (*core_tick)(void);
+static uint32 core_tick_interval;
+
 static void timer_enable()
 {
     // Enable core0 cntp timer
@@ -65,36 +82,42 @@ static timer_proc *tp_alloc()
     uint32 daif;
     uint32 idx;
 
-    daif = save_and_disable_interrupt();
+    daif = spin_lock_irqsave(&timer_lock);
 
     idx = ffs(t_status);
 
     if (idx == 0) {
-        restore_interrupt(daif);
+        spin_unlock_irqrestore(&timer_lock, daif);
 
         return NULL;
     }
 
     t_status &= ~(1 << (idx - 1));
 
-    restore_interrupt(daif);
+    spin_unlock_irqrestore(&timer_lock, daif);
 
     return &t_procs[idx - 1];
 }
 
 static void tp_release(timer_proc *tp)
 {
+    uint32 daif;
+
     if (!tp) {
         return;
     }
 
     uint32 idx = get_elem_idx(tp, t_procs);
 
+    daif = spin_lock_irqsave(&timer_lock);
+
     t_status |= (1 << idx);
+
+    spin_unlock_irqrestore(&timer_lock, daif);
 }
 
 /*
- * Need to disable interrupt before calling this function.
+ * Must be called with @timer_lock held.
  */
 static void timer_update_remain_time()
 {
@@ -128,7 +151,7 @@ static int tp_insert(timer_proc *tp)
     timer_proc *iter;
     int first;
 
-    daif = save_and_disable_interrupt();
+    daif = spin_lock_irqsave(&timer_lock);
 
     // Update remain_time
     timer_update_remain_time();
@@ -146,24 +169,21 @@ static int tp_insert(timer_proc *tp)
 
     t_meta.size += 1;
 
-    restore_interrupt(daif);
+    spin_unlock_irqrestore(&timer_lock, daif);
 
     return first;
 }
 
 /*
  * Set timer
+ *
+ * Must be called with @timer_lock held.
  */
 static void timer_set()
 {
-    uint32 daif;
     timer_proc *tp;
 
-    daif = save_and_disable_interrupt();
-
     if (!t_meta.size) {
-        restore_interrupt(daif);
-
         return;
     }
     
@@ -172,8 +192,6 @@ static void timer_set()
     // Set timer
     t_interval = tp->remain_time;
     write_sysreg(cntp_tval_el0, t_interval);
-
-    restore_interrupt(daif);
 }
 
 static void timer_set_boot_cnt()
@@ -213,14 +231,41 @@ void timer_init()
     timer_add_proc_after(timer_show_boot_time, NULL, 2);
 }
 
+void timer_init_core_tick(void (*tick)(void), uint32 freq)
+{
+    uint64 cntkctl_el1;
+
+    core_tick = tick;
+    core_tick_interval = read_sysreg(cntfrq_el0) / freq;
+
+    // Allow EL0 to access timer
+    cntkctl_el1 = read_sysreg(CNTKCTL_EL1);
+    cntkctl_el1 |= 1;
+    write_sysreg(CNTKCTL_EL1, cntkctl_el1);
+
+    // Enable cntp timer of this core
+    write_sysreg(cntp_ctl_el0, 1);
+    write_sysreg(cntp_tval_el0, core_tick_interval);
+
+    put32(PA2VA(CORE_TIMER_IRQ_CTRL(smp_processor_id())), 2);
+}
+
 int timer_irq_check()
 {
-    uint32 core0_irq_src = get32(PA2VA(CORE0_IRQ_SOURCE));
+    int cpu = smp_processor_id();
+    uint32 core_irq_src = get32(PA2VA(CORE_IRQ_SOURCE(cpu)));
 
-    if (!(core0_irq_src & 0x02)) {
+    if (!(core_irq_src & 0x02)) {
         return 0;
     }
 
+    if (cpu) {
+        write_sysreg(cntp_tval_el0, core_tick_interval);
+        (core_tick)();
+
+        return 1;
+    }
+
     timer_disable();
     if (irq_run_task(timer_irq_handler, NULL, timer_irq_fini, 0)) {
         timer_enable();
@@ -232,8 +277,13 @@ int timer_irq_check()
 static void timer_irq_handler(void *_)
 {
     timer_proc *tp;
+    uint32 daif;
+
+    daif = spin_lock_irqsave(&timer_lock);
 
     if (!t_meta.size) {
+        spin_unlock_irqrestore(&timer_lock, daif);
+
         return;
     }
 
@@ -246,6 +296,8 @@ static void timer_irq_handler(void *_)
     timer_update_remain_time();
     timer_set();
 
+    spin_unlock_irqrestore(&timer_lock, daif);
+
     // Execute the callback function
     (tp->cb)(tp->args);
     tp_release(tp);
@@ -263,12 +315,18 @@ void timer_switch_info()
 
 static void timer_add_proc(timer_proc *tp)
 {
+    uint32 daif;
     int need_update;
 
     need_update = tp_insert(tp);
 
     if (need_update) {
+        daif = spin_lock_irqsave(&timer_lock);
+
         timer_set();
+
+        spin_unlock_irqrestore(&timer_lock, daif);
+
         timer_enable();
     }
 }
@@ -1,5 +1,5 @@
 #include <waitqueue.h>
-#include <preempt.h>
+#include <spinlock.h>
 #include <mm/mm.h>
 
 wait_queue_head *wq_create(void)
@@ -8,6 +8,7 @@ wait_queue_head *wq_create(void)
 
     head = kmalloc(sizeof(wait_queue_head));
 
+    spin_lock_init(&head->lock, "wq");
     INIT_LIST_HEAD(&head->list);
 
     return head;
@@ -20,31 +21,36 @@ int wq_empty(wait_queue_head *head)
 
 void wq_add_task(task_struct *task, wait_queue_head *head)
 {
-    preempt_disable();
+    uint32 daif;
+
+    daif = spin_lock_irqsave(&head->lock);
 
     list_add_tail(&task->list, &head->list);
 
-    preempt_enable();
+    spin_unlock_irqrestore(&head->lock, daif);
 }
 
-void wq_del_task(task_struct *task)
+void wq_del_task(task_struct *task, wait_queue_head *head)
 {
-    preempt_disable();
+    uint32 daif;
+
+    daif = spin_lock_irqsave(&head->lock);
 
     list_del(&task->list);
 
-    preempt_enable();
+    spin_unlock_irqrestore(&head->lock, daif);
 }
 
 task_struct *wq_get_first_task(wait_queue_head *head)
 {
     task_struct *task;
+    uint32 daif;
 
-    preempt_disable();
+    daif = spin_lock_irqsave(&head->lock);
 
     task = list_first_entry(&head->list, task_struct, list);
 
-    preempt_enable();
+    spin_unlock_irqrestore(&head->lock, daif);
 
     return task;
 }
\ No newline at end of file
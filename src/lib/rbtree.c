@@ -0,0 +1,335 @@
+#include <rbtree.h>
+
+static inline int rb_is_black(struct rb_node *node)
+{
+    // NULL leaves are black
+    return !node || node->color == RB_BLACK;
+}
+
+static inline void rb_change_child(struct rb_root *root,
+                                   struct rb_node *parent,
+                                   struct rb_node *old, struct rb_node *new)
+{
+    if (!parent) {
+        root->node = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+/*
+ * @node's right child takes its place.
+ */
+static void rb_rotate_left(struct rb_root *root, struct rb_node *node,
+                           rb_augment_f augment)
+{
+    struct rb_node *right = node->right;
+
+    node->right = right->left;
+    if (right->left) {
+        right->left->parent = node;
+    }
+
+    right->parent = node->parent;
+    rb_change_child(root, node->parent, node, right);
+
+    right->left = node;
+    node->parent = right;
+
+    if (augment) {
+        augment(node);
+        augment(right);
+    }
+}
+
+/*
+ * @node's left child takes its place.
+ */
+static void rb_rotate_right(struct rb_root *root, struct rb_node *node,
+                            rb_augment_f augment)
+{
+    struct rb_node *left = node->left;
+
+    node->left = left->right;
+    if (left->right) {
+        left->right->parent = node;
+    }
+
+    left->parent = node->parent;
+    rb_change_child(root, node->parent, node, left);
+
+    left->right = node;
+    node->parent = left;
+
+    if (augment) {
+        augment(node);
+        augment(left);
+    }
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root,
+                     rb_augment_f augment)
+{
+    struct rb_node *parent, *gparent, *uncle;
+
+    while ((parent = node->parent) && parent->color == RB_RED) {
+        // The root is black, so a red parent has a parent
+        gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            uncle = gparent->right;
+
+            if (!rb_is_black(uncle)) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+
+            if (node == parent->right) {
+                rb_rotate_left(root, parent, augment);
+                node = parent;
+                parent = node->parent;
+            }
+
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(root, gparent, augment);
+        } else {
+            uncle = gparent->left;
+
+            if (!rb_is_black(uncle)) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+
+            if (node == parent->left) {
+                rb_rotate_right(root, parent, augment);
+                node = parent;
+                parent = node->parent;
+            }
+
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(root, gparent, augment);
+        }
+    }
+
+    root->node->color = RB_BLACK;
+}
+
+/*
+ * A black node has been removed from the subtree @node of @parent, @node
+ * may be NULL.
+ */
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent,
+                           struct rb_root *root, rb_augment_f augment)
+{
+    struct rb_node *sibling;
+
+    while (node != root->node && rb_is_black(node)) {
+        if (node == parent->left) {
+            sibling = parent->right;
+
+            if (!rb_is_black(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(root, parent, augment);
+                sibling = parent->right;
+            }
+
+            if (rb_is_black(sibling->left) && rb_is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (rb_is_black(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rb_rotate_right(root, sibling, augment);
+                sibling = parent->right;
+            }
+
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rb_rotate_left(root, parent, augment);
+        } else {
+            sibling = parent->left;
+
+            if (!rb_is_black(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(root, parent, augment);
+                sibling = parent->left;
+            }
+
+            if (rb_is_black(sibling->left) && rb_is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (rb_is_black(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rb_rotate_left(root, sibling, augment);
+                sibling = parent->left;
+            }
+
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rb_rotate_right(root, parent, augment);
+        }
+
+        node = root->node;
+        break;
+    }
+
+    if (node) {
+        node->color = RB_BLACK;
+    }
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root,
+              rb_augment_f augment)
+{
+    struct rb_node *child, *parent;
+    int color;
+
+    if (!node->left || !node->right) {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+
+        if (child) {
+            child->parent = parent;
+        }
+
+        rb_change_child(root, parent, node, child);
+    } else {
+        // Replace @node with its successor
+        struct rb_node *succ = node->right;
+
+        while (succ->left) {
+            succ = succ->left;
+        }
+
+        child = succ->right;
+        color = succ->color;
+
+        if (succ->parent == node) {
+            parent = succ;
+        } else {
+            parent = succ->parent;
+
+            parent->left = child;
+            if (child) {
+                child->parent = parent;
+            }
+
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+
+        succ->left = node->left;
+        node->left->parent = succ;
+
+        succ->parent = node->parent;
+        succ->color = node->color;
+        rb_change_child(root, node->parent, node, succ);
+    }
+
+    // The successor (if any) is an ancestor of @parent
+    if (augment) {
+        rb_propagate(parent, augment);
+    }
+
+    if (color == RB_BLACK) {
+        rb_erase_color(child, parent, root, augment);
+    }
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+    struct rb_node *node = root->node;
+
+    if (!node) {
+        return NULL;
+    }
+
+    while (node->left) {
+        node = node->left;
+    }
+
+    return node;
+}
+
+struct rb_node *rb_last(const struct rb_root *root)
+{
+    struct rb_node *node = root->node;
+
+    if (!node) {
+        return NULL;
+    }
+
+    while (node->right) {
+        node = node->right;
+    }
+
+    return node;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+    struct rb_node *parent;
+
+    if (node->right) {
+        node = node->right;
+
+        while (node->left) {
+            node = node->left;
+        }
+
+        return (struct rb_node *)node;
+    }
+
+    // Go up until we come from a left child
+    while ((parent = node->parent) && node == parent->right) {
+        node = parent;
+    }
+
+    return parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node)
+{
+    struct rb_node *parent;
+
+    if (node->left) {
+        node = node->left;
+
+        while (node->right) {
+            node = node->right;
+        }
+
+        return (struct rb_node *)node;
+    }
+
+    // Go up until we come from a right child
+    while ((parent = node->parent) && node == parent->left) {
+        node = parent;
+    }
+
+    return parent;
+}
@@ -1,24 +1,136 @@
 #include <string.h>
+#include <types.h>
+
+/*
+ * The compares and strlen() go 8 bytes at a time over the aligned words of
+ * @str1. A word is only loaded if the string goes on into it, and aligned
+ * words never cross a page, so nothing is read beyond the word holding the
+ * NUL.
+ */
+typedef uint64 __attribute__((__may_alias__)) word_t;
+
+#define ONES    0x0101010101010101ULL
+#define HIGHS   0x8080808080808080ULL
+
+// Nonzero if @x has a zero byte
+#define has_zero(x) (((x) - ONES) & ~(x) & HIGHS)
+
+/*
+ * Set bit 5 of the bytes of @x in 'A' ~ 'Z'.
+ */
+static inline uint64 fold_word(uint64 x)
+{
+    uint64 low7 = x & ~HIGHS;
+    uint64 ge_a = low7 + (0x80 - 'A') * ONES;
+    uint64 gt_z = low7 + (0x80 - 'Z' - 1) * ONES;
+
+    return x | ((ge_a & ~gt_z & ~x & HIGHS) >> 2);
+}
+
+/*
+ * Return the length of the common prefix of @str1 and @str2 skipped word by
+ * word, up to @n bytes: no NUL in it and equal (case-insensitively if
+ * @fold). @str1 must be 8-byte aligned, @str2 may be not. The bytes after
+ * the prefix are left to the caller.
+ */
+static uint64 word_prefix(const char *str1, const char *str2, uint64 n,
+                          int fold)
+{
+    const word_t *w1, *w2;
+    uint64 sh, a, b, next = 0;
+    uint64 len = 0;
+
+    w1 = (const word_t *)str1;
+    w2 = (const word_t *)((uint64)str2 & ~7ULL);
+    sh = ((uint64)str2 & 7) * 8;
+
+    // The word holding the first byte of @str2
+    if (sh) {
+        next = *w2++;
+    }
+
+    while (len + 8 <= n) {
+        a = *w1;
+
+        if (sh) {
+            b = next >> sh;
+
+            // @str2 ends before its next word
+            if (has_zero(b | (~0ULL << (64 - sh)))) {
+                break;
+            }
+
+            next = *w2++;
+            b |= next << (64 - sh);
+        } else {
+            b = *w2++;
+        }
+
+        if (fold) {
+            a = fold_word(a);
+            b = fold_word(b);
+        }
+
+        if (a != b || has_zero(a)) {
+            break;
+        }
+
+        w1++;
+        len += 8;
+    }
+
+    return len;
+}
 
 int strcmp(const char *str1, const char *str2)
 {
     char c1, c2;
 
-    while ((c1 = *str1++) == (c2 = *str2++) && c1 && c2) {};
+    while (1) {
+        if (!((uint64)str1 & 7)) {
+            uint64 skip = word_prefix(str1, str2, ~0ULL, 0);
 
-    return c1 - c2;
+            str1 += skip;
+            str2 += skip;
+        }
+
+        c1 = *str1++;
+        c2 = *str2++;
+
+        if (c1 != c2 || !c1) {
+            return c1 - c2;
+        }
+    }
 }
 
 int strncmp(const char *str1, const char *str2, int n)
 {
     char c1, c2;
 
-    if (n <= 0)
-        return 0;
+    while (n > 0) {
+        if (!((uint64)str1 & 7)) {
+            uint64 skip = word_prefix(str1, str2, n, 0);
+
+            str1 += skip;
+            str2 += skip;
+            n -= skip;
+
+            if (!n) {
+                break;
+            }
+        }
+
+        c1 = *str1++;
+        c2 = *str2++;
+
+        if (c1 != c2 || !c1) {
+            return c1 - c2;
+        }
 
-    while ((c1 = *str1++) == (c2 = *str2++) && c1 && c2 && --n > 0) {};
+        n--;
+    }
 
-    return n ? c1 - c2 : 0;
+    return 0;
 }
 
 int strcasecmp(const char *s1, const char *s2)
@@ -26,6 +138,13 @@ int strcasecmp(const char *s1, const char *s2)
     char c1, c2;
 
     while (1) {
+        if (!((uint64)s1 & 7)) {
+            uint64 skip = word_prefix(s1, s2, ~0ULL, 1);
+
+            s1 += skip;
+            s2 += skip;
+        }
+
         c1 = *s1++;
         c2 = *s2++;
 
@@ -51,13 +170,30 @@ int strcasecmp(const char *s1, const char *s2)
 
 int strlen(const char *str)
 {
-    int ret = 0;
-    
-    while (*str++) {
-        ret += 1;
+    const char *start = str;
+    const word_t *w;
+
+    while ((uint64)str & 7) {
+        if (!*str) {
+            return str - start;
+        }
+
+        str++;
     }
 
-    return ret;
+    w = (const word_t *)str;
+
+    while (!has_zero(*w)) {
+        w++;
+    }
+
+    str = (const char *)w;
+
+    while (*str) {
+        str++;
+    }
+
+    return str - start;
 }
 
 int strcpy(char *dst, const char *src)